@@ -29,8 +29,15 @@ SCR_SRC_FILES := \
     audio_hal_installer.cpp \
     main.cpp \
     shell.cpp \
+    thread_roles.cpp \
+    alloc_debug.cpp \
+    output_journal.cpp \
+    storage_probe.cpp \
+    faststart.cpp \
 
 SCR_CFLAGS := -D__STDC_CONSTANT_MACROS -DSCR_SDK_VERSION=$(PLATFORM_SDK_VERSION)
+# the scalar and vector audio mixers only give identical results if products aren't fused into multiply-adds
+SCR_CFLAGS += -ffp-contract=off
 
 ifdef SCR_FFMPEG
     SCR_STATIC_LIBRARIES += \
@@ -52,9 +59,23 @@ ifdef SCR_FFMPEG
 
     SCR_SRC_FILES += \
         ffmpeg_output.cpp \
+        audio_convert.cpp \
+        audio_sync.cpp \
+        file_writer.cpp \
+        storage_monitor.cpp \
+        keyframe_index.cpp \
+        remux.cpp \
 
 endif
 
+# build with SCR_ALLOC_DEBUG=y to count heap allocations made while recording
+ifdef SCR_ALLOC_DEBUG
+    SCR_CFLAGS += -DSCR_ALLOC_DEBUG
+ifdef SCR_FFMPEG
+    SCR_LDFLAGS += -Wl,--wrap=av_malloc -Wl,--wrap=av_mallocz -Wl,--wrap=av_realloc
+endif
+endif
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := screenrec
@@ -66,5 +87,22 @@ LOCAL_SHARED_LIBRARIES := $(SCR_SHARED_LIBRARIES)
 LOCAL_STATIC_LIBRARIES := $(SCR_STATIC_LIBRARIES)
 LOCAL_C_INCLUDES := $(SCR_C_INCLUDES)
 LOCAL_LDLIBS := $(LOCAL_CFLAGS)
+LOCAL_LDFLAGS := $(SCR_LDFLAGS)
+include $(BUILD_EXECUTABLE)
+include $(CLEAR_VARS)
+
+# video timestamp test, the shell is replaced by the test main()
+ifdef SCR_FFMPEG
+LOCAL_MODULE := screenrec_pts_test
+LOCAL_CFLAGS := $(SCR_CFLAGS)
+
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := $(filter-out shell.cpp, $(SCR_SRC_FILES)) tests/pts_test.cpp
+LOCAL_SHARED_LIBRARIES := $(SCR_SHARED_LIBRARIES)
+LOCAL_STATIC_LIBRARIES := $(SCR_STATIC_LIBRARIES)
+LOCAL_C_INCLUDES := $(SCR_C_INCLUDES) $(LOCAL_PATH)
+LOCAL_LDLIBS := $(LOCAL_CFLAGS)
+LOCAL_LDFLAGS := $(SCR_LDFLAGS)
 include $(BUILD_EXECUTABLE)
-include $(CLEAR_VARS)
\ No newline at end of file
+include $(CLEAR_VARS)
+endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include "screenrec.h"
+
+#include <new>
+#include <stdlib.h>
+
+// Heap allocation counter used to verify the recording loop doesn't allocate.
+// Enabled with SCR_ALLOC_DEBUG which also wraps the FFmpeg allocator, see Android.mk.
+
+#ifdef SCR_ALLOC_DEBUG
+
+static volatile int32_t allocationCount = 0;
+
+int64_t getAllocationCount() {
+    return allocationCount;
+}
+
+void* operator new(size_t size) {
+    __sync_fetch_and_add(&allocationCount, 1);
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        abort();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) throw() {
+    free(p);
+}
+
+void operator delete[](void *p) throw() {
+    free(p);
+}
+
+#ifdef SCR_FFMPEG
+extern "C" {
+void *__real_av_malloc(size_t size);
+void *__real_av_mallocz(size_t size);
+void *__real_av_realloc(void *ptr, size_t size);
+
+void *__wrap_av_malloc(size_t size) {
+    __sync_fetch_and_add(&allocationCount, 1);
+    return __real_av_malloc(size);
+}
+
+void *__wrap_av_mallocz(size_t size) {
+    __sync_fetch_and_add(&allocationCount, 1);
+    return __real_av_mallocz(size);
+}
+
+void *__wrap_av_realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&allocationCount, 1);
+    return __real_av_realloc(ptr, size);
+}
+}
+#endif // SCR_FFMPEG
+
+#else
+
+int64_t getAllocationCount() {
+    return -1;
+}
+
+#endif // SCR_ALLOC_DEBUG
@@ -0,0 +1,192 @@
+#include "audio_convert.h"
+
+#include <math.h>
+
+static void convertMonoScalar(const int16_t *in, float *out, int frames) {
+    for (int i = 0; i < frames; i++) {
+        out[i] = (float) in[i] * S16_TO_FLOAT_SCALE;
+    }
+}
+
+static void convertStereoScalar(const int16_t *in, float *left, float *right, int frames) {
+    for (int i = 0; i < frames; i++) {
+        left[i] = (float) in[2 * i] * S16_TO_FLOAT_SCALE;
+        right[i] = (float) in[2 * i + 1] * S16_TO_FLOAT_SCALE;
+    }
+}
+
+// Curve above the knee is k + (1 - k) * (u - u^2 / 4) with u = (|x| - k) / (1 - k),
+// it has slope 1 at the knee and reaches 1 with slope 0 at |x| = 2 - k.
+#define MIX_CLIP_LIMIT (2.0f - MIX_CLIP_KNEE)
+
+static inline int16_t mixSample(int16_t a, float scaleA, int16_t b, float scaleB) {
+    float x = (float) a * scaleA + (float) b * scaleB;
+    float m = fabsf(x);
+    if (m > MIX_CLIP_LIMIT) {
+        m = MIX_CLIP_LIMIT;
+    }
+    float u = (m > MIX_CLIP_KNEE ? m - MIX_CLIP_KNEE : 0.0f) * (1.0f / (1.0f - MIX_CLIP_KNEE));
+    float y = ((m < MIX_CLIP_KNEE ? m : MIX_CLIP_KNEE) + (1.0f - MIX_CLIP_KNEE) * (u - u * u * 0.25f)) * 32767.0f;
+    // round half away from zero, the same as the vector implementations
+    return (int16_t) (x < 0.0f ? -(int32_t) (y + 0.5f) : (int32_t) (y + 0.5f));
+}
+
+static void mixScalar(const int16_t *a, float gainA, const int16_t *b, float gainB, int16_t *out, int samples) {
+    const float scaleA = gainA * S16_TO_FLOAT_SCALE;
+    const float scaleB = gainB * S16_TO_FLOAT_SCALE;
+    for (int i = 0; i < samples; i++) {
+        out[i] = mixSample(a[i], scaleA, b[i], scaleB);
+    }
+}
+
+#if defined(SCR_AUDIO_NEON)
+
+static int convertMonoSimd(const int16_t *in, float *out, int frames) {
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        int16x8_t s = vld1q_s16(in + i);
+        vst1q_f32(out + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))), S16_TO_FLOAT_SCALE));
+        vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))), S16_TO_FLOAT_SCALE));
+    }
+    return i;
+}
+
+static int convertStereoSimd(const int16_t *in, float *left, float *right, int frames) {
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        // vld2 deinterleaves 8 stereo frames into left and right vectors
+        int16x8x2_t s = vld2q_s16(in + 2 * i);
+        vst1q_f32(left + i,      vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s.val[0]))), S16_TO_FLOAT_SCALE));
+        vst1q_f32(left + i + 4,  vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s.val[0]))), S16_TO_FLOAT_SCALE));
+        vst1q_f32(right + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s.val[1]))), S16_TO_FLOAT_SCALE));
+        vst1q_f32(right + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s.val[1]))), S16_TO_FLOAT_SCALE));
+    }
+    return i;
+}
+
+static inline float32x4_t softClipNeon(float32x4_t x) {
+    float32x4_t m = vminq_f32(vabsq_f32(x), vdupq_n_f32(MIX_CLIP_LIMIT));
+    float32x4_t u = vmulq_n_f32(vmaxq_f32(vsubq_f32(m, vdupq_n_f32(MIX_CLIP_KNEE)), vdupq_n_f32(0.0f)),
+                                1.0f / (1.0f - MIX_CLIP_KNEE));
+    float32x4_t curve = vsubq_f32(u, vmulq_n_f32(vmulq_f32(u, u), 0.25f));
+    float32x4_t y = vmulq_n_f32(vaddq_f32(vminq_f32(m, vdupq_n_f32(MIX_CLIP_KNEE)),
+                                vmulq_n_f32(curve, 1.0f - MIX_CLIP_KNEE)), 32767.0f);
+    y = vaddq_f32(y, vdupq_n_f32(0.5f));
+    // restore the sign of x, conversion truncates so rounding is half away from zero
+    uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(x), vdupq_n_u32(0x80000000));
+    return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(y), sign));
+}
+
+static int mixSimd(const int16_t *a, float gainA, const int16_t *b, float gainB, int16_t *out, int samples) {
+    const float scaleA = gainA * S16_TO_FLOAT_SCALE;
+    const float scaleB = gainB * S16_TO_FLOAT_SCALE;
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t sa = vld1q_s16(a + i);
+        int16x8_t sb = vld1q_s16(b + i);
+        // separate multiply and add, a fused multiply-add would round differently than the scalar path
+        float32x4_t lo = vaddq_f32(vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(sa))), scaleA),
+                                   vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(sb))), scaleB));
+        float32x4_t hi = vaddq_f32(vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(sa))), scaleA),
+                                   vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(sb))), scaleB));
+        int32x4_t rlo = vcvtq_s32_f32(softClipNeon(lo));
+        int32x4_t rhi = vcvtq_s32_f32(softClipNeon(hi));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(rlo), vqmovn_s32(rhi)));
+    }
+    return i;
+}
+
+#elif defined(SCR_AUDIO_SSE2)
+
+static int convertMonoSimd(const int16_t *in, float *out, int frames) {
+    const __m128 scale = _mm_set1_ps(S16_TO_FLOAT_SCALE);
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *) (in + i));
+        // sign extend by placing samples in the upper halves and shifting back
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    return i;
+}
+
+static int convertStereoSimd(const int16_t *in, float *left, float *right, int frames) {
+    const __m128 scale = _mm_set1_ps(S16_TO_FLOAT_SCALE);
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        // each 32bit lane holds one frame: left sample in the low half, right in the high half
+        __m128i s = _mm_loadu_si128((const __m128i *) (in + 2 * i));
+        __m128i l = _mm_srai_epi32(_mm_slli_epi32(s, 16), 16);
+        __m128i r = _mm_srai_epi32(s, 16);
+        _mm_storeu_ps(left + i,  _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+    }
+    return i;
+}
+
+static inline __m128 softClipSse(__m128 x) {
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 m = _mm_min_ps(_mm_andnot_ps(signMask, x), _mm_set1_ps(MIX_CLIP_LIMIT));
+    __m128 u = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(m, _mm_set1_ps(MIX_CLIP_KNEE)), _mm_setzero_ps()),
+                          _mm_set1_ps(1.0f / (1.0f - MIX_CLIP_KNEE)));
+    __m128 curve = _mm_sub_ps(u, _mm_mul_ps(_mm_mul_ps(u, u), _mm_set1_ps(0.25f)));
+    __m128 y = _mm_mul_ps(_mm_add_ps(_mm_min_ps(m, _mm_set1_ps(MIX_CLIP_KNEE)),
+                          _mm_mul_ps(curve, _mm_set1_ps(1.0f - MIX_CLIP_KNEE))), _mm_set1_ps(32767.0f));
+    y = _mm_add_ps(y, _mm_set1_ps(0.5f));
+    // restore the sign of x, conversion truncates so rounding is half away from zero
+    return _mm_or_ps(y, _mm_and_ps(x, signMask));
+}
+
+static int mixSimd(const int16_t *a, float gainA, const int16_t *b, float gainB, int16_t *out, int samples) {
+    const __m128 scaleA = _mm_set1_ps(gainA * S16_TO_FLOAT_SCALE);
+    const __m128 scaleB = _mm_set1_ps(gainB * S16_TO_FLOAT_SCALE);
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i sa = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i sb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128 alo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(sa, sa), 16));
+        __m128 ahi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(sa, sa), 16));
+        __m128 blo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(sb, sb), 16));
+        __m128 bhi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(sb, sb), 16));
+        __m128 lo = _mm_add_ps(_mm_mul_ps(alo, scaleA), _mm_mul_ps(blo, scaleB));
+        __m128 hi = _mm_add_ps(_mm_mul_ps(ahi, scaleA), _mm_mul_ps(bhi, scaleB));
+        __m128i rlo = _mm_cvttps_epi32(softClipSse(lo));
+        __m128i rhi = _mm_cvttps_epi32(softClipSse(hi));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(rlo, rhi));
+    }
+    return i;
+}
+
+#else
+
+static int convertMonoSimd(const int16_t *in __unused, float *out __unused, int frames __unused) {
+    return 0;
+}
+
+static int convertStereoSimd(const int16_t *in __unused, float *left __unused, float *right __unused, int frames __unused) {
+    return 0;
+}
+
+static int mixSimd(const int16_t *a __unused, float gainA __unused, const int16_t *b __unused, float gainB __unused,
+                   int16_t *out __unused, int samples __unused) {
+    return 0;
+}
+
+#endif
+
+void convertS16ToFltp(const int16_t *in, float **out, int frames, int channels) {
+    if (channels == 2) {
+        int done = convertStereoSimd(in, out[0], out[1], frames);
+        convertStereoScalar(in + 2 * done, out[0] + done, out[1] + done, frames - done);
+    } else {
+        int done = convertMonoSimd(in, out[0], frames);
+        convertMonoScalar(in + done, out[0] + done, frames - done);
+    }
+}
+
+void mixS16(const int16_t *a, float gainA, const int16_t *b, float gainB, int16_t *out, int samples) {
+    int done = mixSimd(a, gainA, b, gainB, out, samples);
+    mixScalar(a + done, gainA, b + done, gainB, out + done, samples - done);
+}
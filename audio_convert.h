@@ -0,0 +1,30 @@
+#ifndef SCREENREC_AUDIO_CONVERT_H
+#define SCREENREC_AUDIO_CONVERT_H
+
+#include <stdint.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCR_AUDIO_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCR_AUDIO_SSE2
+#endif
+
+// 2^-15 so the scaling is exact and all implementations give bit identical results
+#define S16_TO_FLOAT_SCALE (1.0f / 32768.0f)
+
+// Convert interleaved 16bit PCM to planar float in range [-1, 1).
+// out should contain one pointer per channel, only mono and stereo are supported.
+void convertS16ToFltp(const int16_t *in, float **out, int frames, int channels);
+
+// Mixed samples above this fraction of full scale (-1.2dBFS) are soft clipped,
+// 7/8 keeps the curve constants exact in float
+#define MIX_CLIP_KNEE 0.875f
+
+// Mix two interleaved 16bit PCM buffers with per-source gain into out (which may alias a).
+// The sum is linear up to MIX_CLIP_KNEE so normal levels pass unchanged and only overs are
+// smoothly compressed, reaching full scale at 1.125 and never wrapping around.
+void mixS16(const int16_t *a, float gainA, const int16_t *b, float gainB, int16_t *out, int samples);
+
+#endif
@@ -0,0 +1,127 @@
+#include "audio_sync.h"
+
+void AudioSync::init(int sampleRate, int channels, int64_t startTimeUs) {
+    this->sampleRate = sampleRate;
+    this->channels = channels;
+    this->startTimeUs = startTimeUs;
+    silence = new int16_t[msToFrames(AUDIO_MAX_SILENCE_MS) * channels];
+    memset(silence, 0, msToFrames(AUDIO_MAX_SILENCE_MS) * channels * sizeof(int16_t));
+}
+
+void AudioSync::write(SampleRing *ring, const int16_t *samples, int frames, int64_t timeUs) {
+    // the last frame of this buffer was captured approximately at timeUs
+    int64_t expected = (timeUs - startTimeUs) * sampleRate / 1000000ll;
+    updateDrift(framesWritten + frames - expected, timeUs);
+
+    if (pendingSilence > 0) {
+        int64_t count = pendingSilence;
+        if (count > msToFrames(AUDIO_MAX_SILENCE_MS)) {
+            count = msToFrames(AUDIO_MAX_SILENCE_MS);
+        }
+        writeSilence(ring, count);
+        pendingSilence -= count;
+    }
+
+    if (pendingDrop > 0) {
+        int count = pendingDrop < frames ? (int) pendingDrop : frames;
+        samples += count * channels;
+        frames -= count;
+        pendingDrop -= count;
+        droppedFrames += count;
+    }
+
+    if (frames <= 0) {
+        return;
+    }
+
+    // spread small corrections over the buffer, one dropped or repeated frame per segment
+    int64_t pending = pendingCorrection > 0 ? pendingCorrection : -pendingCorrection;
+    int corrections = frames / AUDIO_CORRECTION_RATIO + 1;
+    if (corrections > pending) {
+        corrections = (int) pending;
+    }
+    if (corrections == 0 || frames < 2 * corrections) {
+        ring->write(samples, frames * channels);
+        framesWritten += frames;
+        return;
+    }
+
+    int segment = frames / corrections;
+    for (int i = 0; i < corrections; i++) {
+        int count = (i == corrections - 1) ? frames - i * segment : segment;
+        const int16_t *start = samples + i * segment * channels;
+        if (pendingCorrection > 0) {
+            // audio ahead, skip the last frame of the segment
+            ring->write(start, (count - 1) * channels);
+            framesWritten += count - 1;
+            pendingCorrection--;
+        } else {
+            // audio behind, repeat the last frame of the segment
+            ring->write(start, count * channels);
+            ring->write(start + (count - 1) * channels, channels);
+            framesWritten += count + 1;
+            pendingCorrection++;
+        }
+        correctedFrames++;
+    }
+}
+
+void AudioSync::updateDrift(int64_t drift, int64_t timeUs) {
+    bool first = !anchored;
+    anchored = true;
+
+    if (windowCallbacks == 0 || drift > windowMaxDrift) {
+        windowMaxDrift = drift;
+    }
+    windowCallbacks++;
+
+    // align the beginning of the recording right away, later wait for a full window
+    if (!first && timeUs - windowStartUs < AUDIO_DRIFT_WINDOW_MS * 1000ll) {
+        return;
+    }
+
+    driftEstimate = windowMaxDrift;
+    windowStartUs = timeUs;
+    windowCallbacks = 0;
+
+    // corrections already scheduled but not applied yet
+    int64_t remaining = driftEstimate + pendingSilence - pendingDrop - pendingCorrection;
+
+    if (remaining < -msToFrames(AUDIO_GAP_THRESHOLD_MS) || (first && remaining < 0)) {
+        pendingSilence += -remaining;
+    } else if (remaining > msToFrames(AUDIO_GAP_THRESHOLD_MS)) {
+        pendingDrop += remaining;
+    } else if (remaining > msToFrames(AUDIO_DRIFT_TOLERANCE_MS) || remaining < -msToFrames(AUDIO_DRIFT_TOLERANCE_MS)) {
+        pendingCorrection += remaining;
+    }
+}
+
+void AudioSync::writeSilence(SampleRing *ring, int64_t frames) {
+    ring->write(silence, frames * channels);
+    framesWritten += frames;
+    silenceFrames += frames;
+}
+
+int64_t AudioSync::getDriftUs() {
+    return framesToUs(driftEstimate);
+}
+
+int64_t AudioSync::getSilenceUs() {
+    return framesToUs(silenceFrames);
+}
+
+int64_t AudioSync::getDroppedUs() {
+    return framesToUs(droppedFrames);
+}
+
+int64_t AudioSync::getCorrectedUs() {
+    return framesToUs(correctedFrames);
+}
+
+int64_t AudioSync::framesToUs(int64_t frames) {
+    return sampleRate > 0 ? frames * 1000000ll / sampleRate : 0;
+}
+
+int64_t AudioSync::msToFrames(int64_t ms) {
+    return ms * sampleRate / 1000;
+}
@@ -0,0 +1,86 @@
+#ifndef SCREENREC_AUDIO_SYNC_H
+#define SCREENREC_AUDIO_SYNC_H
+
+#include "sample_ring.h"
+
+#include <stdint.h>
+
+// drift larger than this is corrected at once by inserting silence or dropping samples
+#define AUDIO_GAP_THRESHOLD_MS 100
+// smaller drift above this is corrected by dropping or duplicating single frames
+#define AUDIO_DRIFT_TOLERANCE_MS 10
+// at most one frame in this many is dropped or repeated (0.2%)
+#define AUDIO_CORRECTION_RATIO 500
+// the drift is estimated over callbacks received within this period
+#define AUDIO_DRIFT_WINDOW_MS 1000
+// max silence inserted per callback so that a long gap doesn't overrun the ring
+#define AUDIO_MAX_SILENCE_MS 200
+
+// Keeps the audio sample stream aligned with the capture clock.
+// Each AudioRecord callback is anchored at its arrival time, the difference between
+// the number of frames written and the frames expected at that time is the drift.
+// Callbacks are never early but may be late so the drift is estimated as
+// the maximum observed over a window.
+class AudioSync {
+public:
+    AudioSync()
+        : sampleRate(0),
+          channels(0),
+          startTimeUs(0),
+          framesWritten(0),
+          anchored(false),
+          windowStartUs(0),
+          windowMaxDrift(0),
+          windowCallbacks(0),
+          driftEstimate(0),
+          pendingSilence(0),
+          pendingDrop(0),
+          pendingCorrection(0),
+          silence(NULL),
+          silenceFrames(0),
+          droppedFrames(0),
+          correctedFrames(0) {}
+
+    ~AudioSync() {
+        delete[] silence;
+    }
+
+    void init(int sampleRate, int channels, int64_t startTimeUs);
+
+    // producer side, called from the AudioRecord callback
+    void write(SampleRing *ring, const int16_t *samples, int frames, int64_t timeUs);
+
+    int64_t getDriftUs();
+    int64_t getSilenceUs();
+    int64_t getDroppedUs();
+    int64_t getCorrectedUs();
+
+private:
+    int sampleRate;
+    int channels;
+    int64_t startTimeUs;
+    int64_t framesWritten;
+    bool anchored;
+
+    int64_t windowStartUs;
+    int64_t windowMaxDrift;
+    int windowCallbacks;
+    int64_t driftEstimate;
+
+    int64_t pendingSilence;
+    int64_t pendingDrop;
+    int64_t pendingCorrection;
+
+    int16_t *silence;
+
+    volatile int64_t silenceFrames;
+    volatile int64_t droppedFrames;
+    volatile int64_t correctedFrames;
+
+    void updateDrift(int64_t drift, int64_t timeUs);
+    void writeSilence(SampleRing *ring, int64_t frames);
+    int64_t framesToUs(int64_t frames);
+    int64_t msToFrames(int64_t ms);
+};
+
+#endif
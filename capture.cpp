@@ -179,6 +179,36 @@ void updateScreenshot() {
     }
 }
 
+// Cheap content fingerprint used to detect static screen.
+// Every 4th row is sampled which is still dense enough to catch a blinking cursor.
+uint32_t inputChecksum() {
+    uint32_t hash = 2166136261u;
+    if (inputBase == NULL) {
+        return hash;
+    }
+    const uint32_t *pixels = (const uint32_t *) inputBase;
+    for (int y = 0; y < inputHeight; y += 4) {
+        const uint32_t *row = pixels + y * inputStride;
+        for (int x = 0; x < inputWidth; x++) {
+            hash = (hash ^ row[x]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// The checksum reads 32bit pixels on the CPU, OES input is never mapped to memory
+// and 16bit screens would be sampled past the end of each row.
+bool inputChecksumSupported() {
+    if (useOes) {
+        return false;
+    }
+    if (useFb) {
+        return fbInfo.bits_per_pixel == 32;
+    }
+    return screenshot != NULL && screenshot->getPixels() != NULL
+            && screenshot->getSize() >= (size_t) inputStride * inputHeight * 4;
+}
+
 status_t screenshotUpdate(int reqWidth, int reqHeight) {
     status_t err = NO_ERROR;
 
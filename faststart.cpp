@@ -0,0 +1,196 @@
+#include "faststart.h"
+#include "mov_buffer.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// the ftyp atom written by the mov muxer is a few dozen bytes
+#define FASTSTART_MAX_FTYP_SIZE 256
+
+static bool isContainerAtom(const uint8_t *type) {
+    return memcmp(type, "moov", 4) == 0 || memcmp(type, "trak", 4) == 0 || memcmp(type, "mdia", 4) == 0
+            || memcmp(type, "minf", 4) == 0 || memcmp(type, "stbl", 4) == 0;
+}
+
+// Copies atoms adding delta to all chunk offsets. An stco table is converted to co64
+// if an offset doesn't fit in 32 bits anymore.
+static bool copyPatchedAtoms(MovBuffer *out, const uint8_t *data, int size, int64_t delta) {
+    int pos = 0;
+    while (pos + 8 <= size) {
+        const uint8_t *atom = data + pos;
+        uint32_t atomSize = readBE32(atom);
+        const uint8_t *type = atom + 4;
+        if (atomSize < 8 || atomSize > (uint32_t) (size - pos)) {
+            return false;
+        }
+
+        if (isContainerAtom(type)) {
+            int start = beginAtom(out, (const char*) type);
+            if (!copyPatchedAtoms(out, atom + 8, atomSize - 8, delta)) {
+                return false;
+            }
+            endAtom(out, start);
+        } else if (memcmp(type, "stco", 4) == 0 || memcmp(type, "co64", 4) == 0) {
+            bool wide = memcmp(type, "co64", 4) == 0;
+            int entrySize = wide ? 8 : 4;
+            uint32_t count = atomSize >= 16 ? readBE32(atom + 12) : 0;
+            if (atomSize < 16 || count > (atomSize - 16) / entrySize) {
+                return false;
+            }
+            const uint8_t *entries = atom + 16;
+            bool needWide = wide;
+            for (uint32_t i = 0; i < count && !needWide; i++) {
+                needWide = readBE32(entries + i * 4) + delta > UINT32_MAX;
+            }
+            int start = beginAtom(out, needWide ? "co64" : "stco");
+            putBytes(out, atom + 8, 4); // version and flags
+            put32(out, count);
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t offset = wide ? readBE64(entries + i * 8) : readBE32(entries + i * 4);
+                if (needWide) {
+                    put64(out, offset + delta);
+                } else {
+                    put32(out, offset + delta);
+                }
+            }
+            endAtom(out, start);
+        } else {
+            putBytes(out, atom, atomSize);
+        }
+        pos += atomSize;
+    }
+    return pos == size && !out->failed;
+}
+
+static int readFileType(int fd, int reserveSize, uint8_t *ftyp) {
+    if (pread64(fd, ftyp, 8, reserveSize) != 8 || memcmp(ftyp + 4, "ftyp", 4) != 0) {
+        return -1;
+    }
+    int size = readBE32(ftyp);
+    if (size < 8 || size > FASTSTART_MAX_FTYP_SIZE || pread64(fd, ftyp, size, reserveSize) != size) {
+        return -1;
+    }
+    return size;
+}
+
+int writeMovieHeader(int fd, int reserveSize, const uint8_t *moov, int moovSize) {
+    uint8_t ftyp[FASTSTART_MAX_FTYP_SIZE];
+    int ftypSize = readFileType(fd, reserveSize, ftyp);
+    if (ftypSize < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the copied ftyp atom is followed by the moov atom if it fits, the free atom covers the rest
+    // of the reserved space and the original ftyp atom
+    int64_t regionSize = reserveSize + ftypSize;
+    bool placed = ftypSize + moovSize == regionSize || ftypSize + moovSize + 8 <= regionSize;
+    MovBuffer header;
+    memset(&header, 0, sizeof(header));
+    putBytes(&header, ftyp, ftypSize);
+    if (placed) {
+        putBytes(&header, moov, moovSize);
+    }
+    if (regionSize > header.size) {
+        put32(&header, regionSize - header.size);
+        putBytes(&header, "free", 4);
+    }
+    int ret = -1;
+    if (!header.failed && pwrite64(fd, header.data, header.size, 0) == header.size) {
+        ret = placed ? 1 : 0;
+    }
+    free(header.data);
+    return ret;
+}
+
+int getFaststartReserve(int durationSec, int videoFrameRate, int audioFrameRate) {
+    int64_t size = FASTSTART_MIN_RESERVE + (int64_t) durationSec
+            * (videoFrameRate * FASTSTART_VIDEO_SAMPLE_BYTES + audioFrameRate * FASTSTART_AUDIO_SAMPLE_BYTES);
+    // whole storage blocks so that the media data stays aligned
+    size = (size + 4095) & ~4095ll;
+    return size < INT32_MAX ? size : INT32_MAX & ~4095;
+}
+
+int moveMovieToFront(const char *path, int reserveSize, FaststartStats *stats) {
+    int64_t startUs = getTimeUs();
+    memset(stats, 0, sizeof(FaststartStats));
+    stats->mode = "none";
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return errno;
+    }
+    struct stat fileStat;
+    uint8_t ftyp[FASTSTART_MAX_FTYP_SIZE];
+    int ftypSize = readFileType(fd, reserveSize, ftyp);
+    if (fstat(fd, &fileStat) != 0 || ftypSize < 0) {
+        close(fd);
+        return EINVAL;
+    }
+    int64_t fileSize = fileStat.st_size;
+
+    // the moov atom is the last top level atom written by the muxer
+    int64_t pos = reserveSize;
+    int64_t moovPos = -1;
+    uint32_t moovSize = 0;
+    uint8_t atom[16];
+    while (pos + 8 <= fileSize && pread64(fd, atom, 16, pos) >= 8) {
+        uint64_t size = readBE32(atom);
+        if (size == 1) {
+            size = readBE64(atom + 8);
+        }
+        if (size < 8 || pos + size > (uint64_t) fileSize) {
+            break;
+        }
+        if (memcmp(atom + 4, "moov", 4) == 0 && pos + size == (uint64_t) fileSize) {
+            moovPos = pos;
+            moovSize = size;
+            break;
+        }
+        pos += size;
+    }
+    uint8_t *moov = moovPos > 0 ? (uint8_t*) malloc(moovSize) : NULL;
+    if (moov == NULL || pread64(fd, moov, moovSize, moovPos) != (ssize_t) moovSize) {
+        ALOGE("No moov atom at the end of %s", path);
+        free(moov);
+        close(fd);
+        return EINVAL;
+    }
+
+    // chunk offsets written by the muxer are relative to the end of the reserved space
+    MovBuffer patched;
+    memset(&patched, 0, sizeof(patched));
+    int ret = copyPatchedAtoms(&patched, moov, moovSize, reserveSize) ? 0 : EINVAL;
+    int64_t regionSize = reserveSize + ftypSize;
+    int64_t headerSize = ftypSize + patched.size;
+    bool fits = headerSize == regionSize || headerSize + 8 <= regionSize;
+
+    // Until the header is written the file starts with zeros and has no valid moov atom,
+    // so a crash in between leaves it to journal recovery instead of with wrong offsets.
+    if (ret == 0 && fits) {
+        if (ftruncate64(fd, moovPos) != 0 || writeMovieHeader(fd, reserveSize, patched.data, patched.size) != 1
+                || fsync(fd) != 0) {
+            ret = errno ? errno : EIO;
+        }
+    } else if (ret == 0) {
+        ALOGI("moov atom %d bytes doesn't fit in %d reserved bytes, leaving it at the end", patched.size, reserveSize);
+        if (pwrite64(fd, patched.data, patched.size, moovPos) != patched.size
+                || ftruncate64(fd, moovPos + patched.size) != 0 || fdatasync(fd) != 0
+                || writeMovieHeader(fd, reserveSize, patched.data, patched.size) < 0 || fsync(fd) != 0) {
+            ret = errno ? errno : EIO;
+        }
+    }
+    close(fd);
+
+    if (ret == 0) {
+        stats->mode = fits ? "reserved" : "end";
+        stats->moovSize = patched.size;
+    }
+    stats->timeUs = getTimeUs() - startUs;
+    free(patched.data);
+    free(moov);
+    return ret;
+}
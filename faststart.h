@@ -0,0 +1,40 @@
+#ifndef SCREENREC_FASTSTART_H
+#define SCREENREC_FASTSTART_H
+
+#include "screenrec.h"
+
+#include <stdint.h>
+
+// estimated moov atom bytes per sample: stsz, stts, ctts and a chunk offset and stsc entry each
+#define FASTSTART_VIDEO_SAMPLE_BYTES 40
+#define FASTSTART_AUDIO_SAMPLE_BYTES 28
+// atoms other than the sample tables
+#define FASTSTART_MIN_RESERVE (64 * 1024)
+// recording length the reserved space is sized for when segments don't limit it
+#define FASTSTART_DEFAULT_DURATION (10 * 60)
+
+// What moveMovieToFront() did, printed with the output stats
+struct FaststartStats {
+    const char *mode; // "reserved" if the moov atom fit in the reserved space, "end" otherwise
+    int moovSize;
+    int64_t timeUs;
+};
+
+// Files with reserved header space are written by the muxer starting at offset reserveSize.
+// The ftyp atom is copied to the beginning of the file and followed either by the moov atom
+// or by a free atom covering the rest of the reserved space.
+
+// Moves the moov atom from the end of a completed file to the reserved space at its beginning.
+// If it doesn't fit it stays at the end, media data is never moved so this only writes the header
+// and the moov atom. Returns 0 or errno.
+int moveMovieToFront(const char *path, int reserveSize, FaststartStats *stats);
+
+// Reserved space for a moov atom covering durationSec of video and audio samples.
+int getFaststartReserve(int durationSec, int videoFrameRate, int audioFrameRate);
+
+// Writes the header of a file with reserved space using a moov atom which already has final
+// chunk offsets. Returns 1 if the moov atom was placed at the beginning, 0 if it didn't fit
+// and has to be appended by the caller, -1 on error.
+int writeMovieHeader(int fd, int reserveSize, const uint8_t *moov, int moovSize);
+
+#endif
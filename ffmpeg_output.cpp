@@ -1,5 +1,15 @@
 #include "ffmpeg_output.h"
 
+// "balanced" matches the settings used before presets were introduced
+const EncoderPreset FFmpegOutput::presets[] = {
+    // name         mb_decision               me_method  me_range subpel b-frames trellis flags
+    { "ultrafast",  FF_MB_DECISION_SIMPLE,    ME_ZERO,   0,       0,     0,       0,      0 },
+    { "fast",       FF_MB_DECISION_SIMPLE,    ME_EPZS,   16,      2,     0,       0,      0 },
+    { "balanced",   FF_MB_DECISION_RD,        ME_EPZS,   0,       8,     1,       0,      0 },
+    { "quality",    FF_MB_DECISION_RD,        ME_EPZS,   0,       8,     2,       1,      CODEC_FLAG_4MV | CODEC_FLAG_AC_PRED },
+    { NULL,         0,                        0,         0,       0,     0,       0,      0 }
+};
+
 void FFmpegOutput::setupOutput() {
     int ret;
 
@@ -14,17 +24,25 @@ void FFmpegOutput::setupOutput() {
     }
 
     setupOutputFile();
+    startMuxer();
+
+    // audio is anchored to this time so it has to be set before audio input starts
+    startTimeUs = getTimeUs();
 
     if (audioSource != SCR_AUDIO_MUTE) {
         startAudioInput();
     }
 
-    startTimeMs = getTimeMs();
-
     mrRunning = true;
 
-    pthread_mutex_lock(&frameReadyMutex);
     pthread_create(&encodingThread, NULL, FFmpegOutput::encodingThreadStart, this);
+
+    if (audioRecordStarted) {
+        if (pthread_create(&audioEncodingThread, NULL, FFmpegOutput::audioEncodingThreadStart, this) != 0) {
+            stop(237, "Can't start audio encoding thread");
+        }
+        audioEncodingThreadStarted = true;
+    }
 }
 
 
@@ -70,13 +88,18 @@ void FFmpegOutput::setupVideoStream() {
     c->bit_rate = videoBitrate;
     c->width = videoWidth;
     c->height = videoHeight;
-    /* frames per second */
-    c->time_base= (AVRational){1,10};
-    c->gop_size = 10; /* emit one intra frame every ten frames */
-    c->max_b_frames=1;
+    /* fine grained time base for variable frame rate timestamps,
+       ticks_per_frame keeps the nominal frame rate used by rate control */
+    c->time_base = (AVRational){1, VIDEO_TIME_BASE};
+    c->ticks_per_frame = VIDEO_TIME_BASE / frameRate;
+    c->gop_size = frameRate * keyframeInterval;
     c->pix_fmt = AV_PIX_FMT_YUV420P;
-    c->thread_count = 4;
-    c->mb_decision = 2;
+    c->thread_count = getEncoderThreadCount();
+    c->thread_type = FF_THREAD_SLICE; // the only threading supported by MPEG-4 encoder
+    applyEncoderPreset(c);
+    if (testMode) {
+        c->flags |= CODEC_FLAG_PSNR;
+    }
 
     int rot = rotation;
     if (rot) {
@@ -93,11 +116,71 @@ void FFmpegOutput::setupVideoStream() {
         ALOGE("Could not open video codec");
         stop(235, "Could not open video codec");
     }
+    baseQmin = c->qmin;
+
+    // the MPEG-4 encoder requires room for the worst case macroblock size in packets it doesn't allocate,
+    // only the pages actually written are backed by memory
+    int macroblocks = ((c->width + 15) / 16) * ((c->height + 15) / 16);
+    videoScratchSize = macroblocks * (MPEG4_MAX_MB_BYTES + 100) + FF_MIN_BUFFER_SIZE;
+    videoScratch = (uint8_t*) av_malloc(videoScratchSize);
+    if (!videoScratch) {
+        stop(234, "Could not allocate video packet buffer");
+    }
+}
+
+// Size encoder threads to the CPUs left after capture/conversion on the main thread
+// and audio encoding, but no more than the CPUs the encoder role is placed on.
+int FFmpegOutput::getEncoderThreadCount() {
+    if (encoderThreads <= 0) {
+        int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int reserved = (audioSource != SCR_AUDIO_MUTE) ? 2 : 1;
+        encoderThreads = cpus - reserved;
+
+        int roleCpus = getThreadRoleCpuCount(THREAD_VIDEO_ENCODER);
+        if (roleCpus > 0 && encoderThreads > roleCpus) {
+            encoderThreads = roleCpus;
+        }
+        ALOGV("online CPUs: %d, encoder CPUs: %d", cpus, roleCpus);
+    }
+    if (encoderThreads < 1) {
+        encoderThreads = 1;
+    } else if (encoderThreads > 8) {
+        encoderThreads = 8;
+    }
+    ALOGI("Using %d encoder threads", encoderThreads);
+    return encoderThreads;
+}
+
+void FFmpegOutput::applyEncoderPreset(AVCodecContext *c) {
+    preset = &presets[2];
+    for (const EncoderPreset *p = presets; p->name != NULL; p++) {
+        if (strcmp(p->name, encoderPreset) == 0) {
+            preset = p;
+            break;
+        }
+    }
+    if (strcmp(preset->name, encoderPreset) != 0) {
+        ALOGW("Unknown encoder preset %s, using %s", encoderPreset, preset->name);
+        strcpy(encoderPreset, preset->name);
+    }
+
+    c->mb_decision = preset->mbDecision;
+    c->me_method = preset->meMethod;
+    c->me_range = preset->meRange;
+    c->me_subpel_quality = preset->subpelQuality;
+    c->max_b_frames = preset->maxBFrames;
+    c->trellis = preset->trellis;
+    c->flags |= preset->flags;
+    ALOGI("Encoder preset %s", preset->name);
 }
 
 void FFmpegOutput::setupFrames() {
-    frames[0] = createFrame();
-    frames[1] = createFrame();
+    if (!frameQueue.init(frameQueueDepth)) {
+        stop(234, "Could not allocate frame queue");
+    }
+    for (int i = 0; i < frameQueue.getCapacity(); i++) {
+        *frameQueue.slot(i) = createFrame();
+    }
 }
 
 
@@ -139,6 +222,7 @@ void FFmpegOutput::setupAudioOutput() {
     c->bit_rate    = audioChannels * 64000;
     c->sample_rate = audioSamplingRate;
     c->channels    = audioChannels;
+    c->time_base   = (AVRational){1, audioSamplingRate};
     c->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
     /* Some formats want stream headers to be separate. */
@@ -159,37 +243,509 @@ void FFmpegOutput::setupAudioOutput() {
         stop(236, "Could not allocate audio samples buffer");
     }
 
+    // reused for every audio frame, only pts changes
+    audioFrame = avcodec_alloc_frame();
+    if (!audioFrame) {
+        stop(236, "Could not allocate audio frame");
+    }
+    audioFrame->nb_samples = audioFrameSize;
+    avcodec_fill_audio_frame(audioFrame, c->channels, c->sample_fmt, (uint8_t *)outSamples,
+                            audioFrameSize * av_get_bytes_per_sample(c->sample_fmt) * c->channels, 1);
+
+    // AAC encoder packets are limited to 768 bytes per channel
+    audioScratchSize = 768 * c->channels + FF_MIN_BUFFER_SIZE;
+    audioScratch = (uint8_t*) av_malloc(audioScratchSize);
+    if (!audioScratch) {
+        stop(236, "Could not allocate audio packet buffer");
+    }
+
     audioStream->time_base= (AVRational){1,audioSamplingRate};
 }
 
 
 void FFmpegOutput::setupOutputFile() {
-    int ret;
-    ret = avio_open(&oc->pb, outputName, AVIO_FLAG_WRITE);
-    if (ret < 0 && fixOutputName()) {
-        ret = avio_open(&oc->pb, outputName, AVIO_FLAG_WRITE);
+    segment = new OutputSegment();
+    segment->oc = oc;
+    segment->path = outputName;
+
+    int ret = openSegment(segment);
+    if (ret != 0 && fixOutputName()) {
+        segment->path = outputName;
+        ret = openSegment(segment);
     }
-    if (ret < 0) {
+    if (ret != 0) {
         stop(201, "Could not open the output file");
     }
 
+    segmentSizeLimit = (int64_t) segmentSize * 1024 * 1024;
+    struct statfs stats;
+    if (segmentSizeLimit == 0 && statfs(outputName, &stats) == 0 && stats.f_type == MSDOS_SUPER_MAGIC) {
+        // FAT can't store files of 4GiB or more, leave room for the moov atom
+        segmentSizeLimit = FAT_SEGMENT_SIZE;
+    }
+    if (segmentSizeLimit > 0 || segmentDuration > 0) {
+        ALOGI("segmented output, max %lld bytes, %ds per segment", segmentSizeLimit, segmentDuration);
+    }
+
     /* Write the stream header, if any. */
-    ret = avformat_write_header(oc, NULL);
+    ret = writeSegmentHeader(segment);
     if (ret < 0) {
         stop(247, "Error occurred when writing file header");
     }
+
+    if (storageMonitorInterval > 0) {
+        // packets still queued for the muxer are written after the recording is stopped
+        storageMonitor.start(outputName, storageMonitorInterval * 1000, muxerBufferSize + muxerBufferSize / 16);
+    }
+}
+
+static bool isMovFormat(AVOutputFormat *format) {
+    return strcmp(format->name, "mp4") == 0 || strcmp(format->name, "mov") == 0;
+}
+
+// Opens the segment file and attaches it to the segment format context.
+int FFmpegOutput::openSegment(OutputSegment *s) {
+    s->writer = new FileWriter();
+    int flags = (dropWriteCache ? FILE_WRITER_DROP_CACHE : 0) | (directWrites ? FILE_WRITER_DIRECT : 0);
+    int ret = s->writer->open(s->path, writeChunkSize, preallocateSize, flags);
+    if (ret != 0) {
+        s->writer->close();
+        delete s->writer;
+        s->writer = NULL;
+        return ret;
+    }
+    if (storageMonitorInterval > 0) {
+        s->writer->setMonitor(&storageMonitor);
+    }
+
+    // FFmpeg buffers small writes, large chunks are assembled by the file writer
+    uint8_t *ioBuffer = (uint8_t*) av_malloc(AVIO_BUFFER_SIZE);
+    s->oc->pb = avio_alloc_context(ioBuffer, AVIO_BUFFER_SIZE, 1, s, NULL, writeOutput, seekOutput);
+    if (ioBuffer == NULL || s->oc->pb == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+// Space for the moov atom of a segment, sized for the number of samples it's expected to hold
+// unless set with the faststart option.
+int FFmpegOutput::getHeaderReserve() {
+    if (faststartReserve >= 0) {
+        return faststartReserve;
+    }
+    int64_t durationSec = segmentDuration > 0 ? segmentDuration : FASTSTART_DEFAULT_DURATION;
+    int64_t bitrate = videoBitrate + (audioStream != NULL ? audioStream->codec->bit_rate : 0);
+    if (segmentSizeLimit > 0 && bitrate > 0) {
+        durationSec = FFMIN(durationSec, segmentSizeLimit * 8 / bitrate);
+    }
+    int audioFrameRate = audioStream != NULL && audioFrameSize > 0 ? audioSamplingRate / audioFrameSize : 0;
+    return getFaststartReserve(durationSec, frameRate > 0 ? frameRate : 60, audioFrameRate);
+}
+
+int FFmpegOutput::writeSegmentHeader(OutputSegment *s) {
+    // space for moving the moov atom to the front when the file is complete,
+    // fragmented files have it there already
+    s->headerReserve = 0;
+    if (fragmentDuration == 0 && isMovFormat(s->oc->oformat)) {
+        s->headerReserve = getHeaderReserve();
+        if (s->headerReserve > 0) {
+            s->writer->seek(s->headerReserve, SEEK_SET);
+        }
+    }
+
+    // Fragmented MP4: the header has an empty moov and each fragment carries its own sample tables
+    // so muxer memory doesn't grow and a killed recording stays playable up to the last fragment.
+    AVDictionary *options = NULL;
+    if (fragmentDuration > 0) {
+        char value[32];
+        sprintf(value, "%lld", fragmentDuration * 1000000ll);
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov", 0);
+        av_dict_set(&options, "frag_duration", value, 0);
+        if (s->index == 0) {
+            ALOGI("fragmented output, fragments start at key frames and at least every %ds", fragmentDuration);
+        }
+    }
+
+    int ret = avformat_write_header(s->oc, &options);
+    av_dict_free(&options);
+    if (ret >= 0) {
+        startJournal(s);
+        startKeyframeIndex(s);
+    }
+    return ret;
+}
+
+// Not written for fragmented output, the mov muxer buffers the packets of a fragment
+// so their file positions aren't known when they are written.
+void FFmpegOutput::startKeyframeIndex(OutputSegment *s) {
+    if (!keyframeIndex || fragmentDuration > 0) {
+        return;
+    }
+    // timestamps are written in the muxer time base of the segment
+    AVRational timeBase = s->oc->streams[videoStream->index]->time_base;
+    s->keyframes = new KeyframeIndex();
+    int ret = s->keyframes->open(s->path, timeBase.den / timeBase.num);
+    if (ret != 0) {
+        ALOGW("Can't write keyframe index for %s %s", s->path, strerror(ret));
+        s->keyframes->close();
+        delete s->keyframes;
+        s->keyframes = NULL;
+    }
+}
+
+// Regular MP4 files are unplayable until the moov atom is written at the end,
+// the journal lets recoverRecording() rebuild it if the recording is killed.
+void FFmpegOutput::startJournal(OutputSegment *s) {
+    if (!outputJournal || fragmentDuration > 0 || s->oc->nb_streams > 2 || !isMovFormat(s->oc->oformat)) {
+        return;
+    }
+
+    JournalStream streams[2];
+    const uint8_t *extradata[2];
+    memset(streams, 0, sizeof(streams));
+    for (unsigned int i = 0; i < s->oc->nb_streams; i++) {
+        AVStream *st = s->oc->streams[i];
+        AVCodecContext *c = st->codec;
+        bool video = c->codec_type == AVMEDIA_TYPE_VIDEO;
+        streams[i].type = video ? JOURNAL_STREAM_VIDEO : JOURNAL_STREAM_AUDIO;
+        streams[i].objectType = video ? JOURNAL_OBJECT_MPEG4_VISUAL : JOURNAL_OBJECT_AAC;
+        streams[i].timeScale = st->time_base.den / st->time_base.num;
+        streams[i].width = c->width;
+        streams[i].height = c->height;
+        streams[i].sampleRate = c->sample_rate;
+        streams[i].channels = c->channels;
+        streams[i].bitRate = c->bit_rate;
+        streams[i].extradataSize = c->extradata_size;
+        extradata[i] = c->extradata;
+    }
+
+    s->journal = new OutputJournal();
+    int ret = s->journal->open(s->path);
+    if (ret == 0) {
+        ret = s->journal->writeHeader(avio_tell(s->oc->pb) + s->headerReserve, s->headerReserve,
+                streams, extradata, s->oc->nb_streams);
+    }
+    if (ret != 0) {
+        ALOGW("Can't write journal for %s %s", s->path, strerror(ret));
+        s->journal->close(true);
+        delete s->journal;
+        s->journal = NULL;
+    }
+}
+
+// Creates the following segment with the streams of the primary output context, the encoders
+// keep using the codec contexts of the primary context so only a copy is attached here.
+FFmpegOutput::OutputSegment* FFmpegOutput::createSegment(int index) {
+    OutputSegment *s = new OutputSegment();
+    s->index = index;
+
+    const char *extension = strrchr(outputName, '.');
+    int baseLength = (extension != NULL && strchr(extension, '/') == NULL) ? extension - outputName : strlen(outputName);
+    s->path = new char[strlen(outputName) + 16];
+    sprintf(s->path, "%.*s_%03d%s", baseLength, outputName, index + 1, outputName + baseLength);
+
+    avformat_alloc_output_context2(&s->oc, oc->oformat, NULL, s->path);
+    if (s->oc == NULL) {
+        ALOGE("Can't alloc output context for %s", s->path);
+        delete[] s->path;
+        delete s;
+        return NULL;
+    }
+    for (unsigned int i = 0; i < oc->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(s->oc, NULL);
+        if (st == NULL || avcodec_copy_context(st->codec, oc->streams[i]->codec) < 0) {
+            ALOGE("Can't copy stream %d for %s", i, s->path);
+            closeSegment(s, false);
+            return NULL;
+        }
+        st->time_base = oc->streams[i]->time_base;
+        av_dict_copy(&st->metadata, oc->streams[i]->metadata, 0);
+    }
+
+    if (openSegment(s) != 0 || writeSegmentHeader(s) < 0) {
+        ALOGE("Can't open output segment %s", s->path);
+        closeSegment(s, false);
+        unlink(s->path);
+        return NULL;
+    }
+    return s;
+}
+
+// Writes the trailer and closes the file, frees the format context unless it's the primary one.
+void FFmpegOutput::closeSegment(OutputSegment *s, bool complete) {
+    closeSegmentFile(s, complete);
+    finishSegment(s, complete);
+}
+
+// The part of closing a segment which needs the muxer, the rest is done by finishSegment().
+void FFmpegOutput::closeSegmentFile(OutputSegment *s, bool complete) {
+    s->finished = false;
+    if (s->oc->pb) {
+        if (complete) {
+            s->finished = av_write_trailer(s->oc) == 0;
+        }
+        avio_flush(s->oc->pb);
+    }
+    if (s->writer != NULL) {
+        if (s->writer->close() != 0) {
+            ALOGE("Error closing output file %s", strerror(s->writer->getError()));
+            s->finished = false;
+        }
+        if (complete) {
+            s->writer->printStats();
+        }
+        if (complete && (segmentSizeLimit > 0 || segmentDuration > 0 || s->index > 0)) {
+            ALOGI("segment %d: %lld bytes, %lldms, %s", s->index, s->writer->getSize(), s->durationUs / 1000, s->path);
+            printf("segment %d %lld %lldms %s\n", s->index, s->writer->getSize(), s->durationUs / 1000, s->path);
+            fflush(stdout);
+        }
+        delete s->writer;
+        s->writer = NULL;
+    }
+}
+
+// Moves the moov atom of a closed segment to the front and completes its sidecar files.
+void FFmpegOutput::finishSegment(OutputSegment *s, bool complete) {
+    bool finished = s->finished;
+    if (finished && s->headerReserve > 0) {
+        FaststartStats stats;
+        int ret = moveMovieToFront(s->path, s->headerReserve, &stats);
+        if (ret != 0) {
+            // the journal is kept, recovery writes a valid header
+            ALOGE("Can't move the moov atom of %s %s", s->path, strerror(ret));
+            finished = false;
+        }
+        ALOGI("faststart %s moov:%d %lldms", stats.mode, stats.moovSize, stats.timeUs / 1000);
+        printf("faststart %s %d %lldms\n", stats.mode, stats.moovSize, stats.timeUs / 1000);
+        fflush(stdout);
+    }
+    if (s->keyframes != NULL) {
+        if (complete) {
+            // offsets were recorded in file positions and media data is never moved
+            if (s->keyframes->finish(0) != 0) {
+                ALOGE("Error writing keyframe index of %s", s->path);
+            }
+            s->keyframes->printStats();
+        }
+        s->keyframes->close();
+        delete s->keyframes;
+        s->keyframes = NULL;
+        if (!complete) {
+            char indexPath[PATH_MAX];
+            snprintf(indexPath, sizeof(indexPath), "%s" KEYFRAME_INDEX_SUFFIX, s->path);
+            unlink(indexPath);
+        }
+    }
+    if (s->journal != NULL) {
+        // kept only if the file may need recovery, unfinished segments are deleted
+        s->journal->close(finished || !complete);
+        if (complete) {
+            s->journal->printStats();
+        }
+        delete s->journal;
+        s->journal = NULL;
+    }
+    if (s->oc->pb) {
+        av_free(s->oc->pb->buffer);
+        av_free(s->oc->pb);
+        s->oc->pb = NULL;
+    }
+    if (s->oc != oc) {
+        avformat_free_context(s->oc);
+        s->oc = NULL;
+    }
+}
+
+// Hands a segment closed by the muxer to the finalizer thread which frees it when done.
+// The muxer only waits here if several segments are still being completed.
+void FFmpegOutput::queueFinishedSegment(OutputSegment *s) {
+    if (!finalizeThreadStarted) {
+        if (finishedSegments.init(FINALIZE_QUEUE_SEGMENTS)
+                && pthread_create(&finalizeThread, NULL, FFmpegOutput::finalizeThreadStart, this) == 0) {
+            finalizeThreadStarted = true;
+        } else {
+            ALOGW("Can't start segment finalizer thread, completing %s on the muxer", s->path);
+        }
+    }
+    OutputSegment **slot = finalizeThreadStarted ? finishedSegments.beginWrite(true) : NULL;
+    if (slot != NULL) {
+        *slot = s;
+        finishedSegments.commitWrite();
+        return;
+    }
+    finishSegment(s, true);
+    if (s->path != outputName) {
+        delete[] s->path;
+    }
+    delete s;
+}
+
+void* FFmpegOutput::finalizeThreadStart(void* args) {
+    FFmpegOutput *output = static_cast<FFmpegOutput*>(args);
+    applyThreadRole(THREAD_MUXER);
+    output->runFinalizer();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void FFmpegOutput::runFinalizer() {
+    OutputSegment **slot;
+    while ((slot = finishedSegments.beginRead(true)) != NULL) {
+        OutputSegment *s = *slot;
+        finishedSegments.commitRead();
+        finishSegment(s, true);
+        if (s->path != outputName) {
+            delete[] s->path;
+        }
+        delete s;
+    }
+}
+
+// Called by the muxer for each packet. The next segment is opened and its header written
+// when the current one is close to the limit so that switching at a key frame is immediate.
+// split switches at the next key frame regardless of the limits.
+void FFmpegOutput::updateSegments(AVPacket *pkt, bool video, bool split) {
+    if (video) {
+        segment->durationUs = av_rescale_q(pkt->dts - segment->startDts, videoStream->codec->time_base, AV_TIME_BASE_Q);
+    }
+    int64_t size = segment->writer->getSize();
+    int64_t durationLimitUs = segmentDuration * 1000000ll;
+
+    bool nearLimit = split || (segmentSizeLimit > 0 && size >= segmentSizeLimit / 10 * 9) ||
+            (durationLimitUs > 0 && segment->durationUs >= durationLimitUs / 10 * 9);
+    if (nearLimit && nextSegment == NULL) {
+        nextSegment = createSegment(segment->index + 1);
+        if (nextSegment == NULL) {
+            // keep recording to the current file
+            segmentSizeLimit = 0;
+            segmentDuration = 0;
+            storageMonitor.clearSplitRequest();
+            return;
+        }
+    }
+
+    bool limitReached = split || (segmentSizeLimit > 0 && size >= segmentSizeLimit) ||
+            (durationLimitUs > 0 && segment->durationUs >= durationLimitUs);
+    switchPending = limitReached && nextSegment != NULL;
+    if (switchPending && video && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        switchPending = false;
+        int64_t switchStartUs = getTimeUs();
+        OutputSegment *previous = segment;
+        segment = nextSegment;
+        nextSegment = NULL;
+        segment->startDts = pkt->dts;
+        storageMonitor.clearSplitRequest();
+        storageMonitor.segmentStarted();
+
+        closeSegmentFile(previous, true);
+        queueFinishedSegment(previous);
+
+        int64_t switchUs = getTimeUs() - switchStartUs;
+        ALOGI("switched to segment %d in %lldms", segment->index, switchUs / 1000);
+        printf("segment_switch %d %lldms\n", segment->index, switchUs / 1000);
+        fflush(stdout);
+    }
+}
+
+int FFmpegOutput::writeOutput(void *opaque, uint8_t *buf, int size) {
+    int ret = static_cast<OutputSegment*>(opaque)->writer->write(buf, size);
+    return ret == 0 ? size : AVERROR(ret);
+}
+
+// the muxer sees the file without the reserved header space
+int64_t FFmpegOutput::seekOutput(void *opaque, int64_t offset, int whence) {
+    OutputSegment *s = static_cast<OutputSegment*>(opaque);
+    if (whence == AVSEEK_SIZE) {
+        return s->writer->getSize() - s->headerReserve;
+    }
+    whence &= ~AVSEEK_FORCE;
+    if (whence == SEEK_SET) {
+        offset += s->headerReserve;
+    }
+    int64_t ret = s->writer->seek(offset, whence);
+    return ret < 0 ? AVERROR(EINVAL) : ret - s->headerReserve;
 }
 
 void FFmpegOutput::startAudioInput() {
     int err;
 
-    inSamplesSize = audioSamplingRate; // buffer up to one second of input audio data
-    inSamples = new float[inSamplesSize];
+    // native rates first so that the HAL doesn't have to resample
+    int rates[] = { audioCaptureRate, 48000, 44100, audioSamplingRate };
+
+    for (int i = 0; i < 4 && audioRecord == NULL; i++) {
+        if (rates[i] <= 0) {
+            continue;
+        }
+        captureRate = rates[i];
+        captureChannels = audioChannels;
+        audioRecord = openAudioRecord(AUDIO_SOURCE_MIC, captureRate, captureChannels, &staticAudioRecordCallback);
+        if (audioRecord == NULL && audioChannels == 2) {
+            captureChannels = 1;
+            audioRecord = openAudioRecord(AUDIO_SOURCE_MIC, captureRate, captureChannels, &staticAudioRecordCallback);
+        }
+    }
+    if (audioRecord == NULL) {
+        stop(250, "audioRecord->initCheck() failed");
+        return;
+    }
+    ALOGI("audio captured at %dHz %d channels, encoded at %dHz %d channels",
+            captureRate, captureChannels, audioSamplingRate, audioChannels);
+
+    // buffer at least one second of input audio data
+    if (!inSamples.init(captureRate * captureChannels)) {
+        stop(236, "Could not allocate audio input buffer");
+    }
+    audioSync.init(captureRate, captureChannels, startTimeUs);
+
+    if (captureRate != audioSamplingRate || captureChannels != audioChannels) {
+        setupResampler();
+    }
+    inFrame = new int16_t[FFMAX(audioFrameSize, inChunkFrames) * captureChannels];
+
+    if (audioSource == SCR_AUDIO_MIX) {
+        openInternalAudio();
+    }
+
+    err = audioRecord->start();
+    if (err != NO_ERROR) {
+        stop(237, "Can't start audio source");
+    }
+    audioRecordStarted = true;
+
+    if (internalRecord != NULL) {
+        if (internalRecord->start() == NO_ERROR) {
+            internalRecordStarted = true;
+        } else {
+            ALOGW("Can't start internal audio source, recording microphone only");
+        }
+    }
+}
+
+// Internal audio is captured separately and mixed with the microphone on the audio encoding thread.
+// It's opened in the microphone format so that both rings are aligned sample by sample.
+void FFmpegOutput::openInternalAudio() {
+#if SCR_SDK_VERSION >= 19
+    internalRecord = openAudioRecord(AUDIO_SOURCE_REMOTE_SUBMIX, captureRate, captureChannels, &staticInternalAudioCallback);
+    if (internalRecord == NULL) {
+        ALOGW("Internal audio not available, recording microphone only");
+        return;
+    }
+    if (!internalSamples.init(captureRate * captureChannels)) {
+        stop(236, "Could not allocate audio input buffer");
+    }
+    internalSync.init(captureRate, captureChannels, startTimeUs);
+    mixFrame = new int16_t[FFMAX(audioFrameSize, inChunkFrames) * captureChannels];
+    ALOGI("mixing internal audio, gain mic: %d%%, internal: %d%%", micGain, internalGain);
+#else
+    ALOGW("Internal audio capture requires Android 4.4, recording microphone only");
+#endif // SCR_SDK_VERSION >= 19
+}
 
-    audioRecord = new AudioRecord(AUDIO_SOURCE_MIC,
-                        audioSamplingRate,
+AudioRecord* FFmpegOutput::openAudioRecord(audio_source_t source, int rate, int channels, AudioRecord::callback_t callback) {
+    AudioRecord *record = new AudioRecord(source,
+                        rate,
                         AUDIO_FORMAT_PCM_16_BIT,
-                        audioChannels == 2 ? AUDIO_CHANNEL_IN_STEREO : AUDIO_CHANNEL_IN_MONO,
+                        channels == 2 ? AUDIO_CHANNEL_IN_STEREO : AUDIO_CHANNEL_IN_MONO,
     #if SCR_SDK_VERSION >= 23
                         String16("com.iwobanas.screenrecorder.pro"),
     #endif // SCR_SDK_VERSION >= 23
@@ -197,19 +753,34 @@ void FFmpegOutput::startAudioInput() {
     #if SCR_SDK_VERSION < 17
                         (AudioRecord::record_flags) 0,
     #endif // SCR_SDK_VERSION < 17
-                        &staticAudioRecordCallback,
+                        callback,
                         this);
 
-    err = audioRecord->initCheck();
-    if (err != NO_ERROR) {
-        stop(250, "audioRecord->initCheck() failed");
-        return;
+    if (record->initCheck() != NO_ERROR) {
+        ALOGW("AudioRecord source %d not available at %dHz %d channels", source, rate, channels);
+        // not deleted as the destructor causes SIGSEGV on many devices
+        return NULL;
     }
-    err = audioRecord->start();
-    if (err != NO_ERROR) {
-        stop(237, "Can't start audio source");
+    return record;
+}
+
+void FFmpegOutput::setupResampler() {
+    swr = swr_alloc_set_opts(NULL,
+                        av_get_default_channel_layout(audioChannels), AV_SAMPLE_FMT_FLTP, audioSamplingRate,
+                        av_get_default_channel_layout(captureChannels), AV_SAMPLE_FMT_S16, captureRate,
+                        0, NULL);
+    if (swr == NULL || swr_init(swr) < 0) {
+        stop(252, "Could not initialize audio resampler");
+    }
+
+    // input read per conversion, about one codec frame
+    inChunkFrames = (int) av_rescale_rnd(audioFrameSize, captureRate, audioSamplingRate, AV_ROUND_UP);
+    resampleCapacity = (int) av_rescale_rnd(inChunkFrames, audioSamplingRate, captureRate, AV_ROUND_UP) + 64;
+    resampleBuffer = (float*) av_malloc(resampleCapacity * audioChannels * sizeof(float));
+    resampleFifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, audioChannels, 2 * audioFrameSize);
+    if (resampleBuffer == NULL || resampleFifo == NULL) {
+        stop(236, "Could not allocate audio resampler buffers");
     }
-    audioRecordStarted = true;
 }
 
 static void staticAudioRecordCallback(int event, void* user, void *info) {
@@ -220,62 +791,128 @@ static void staticAudioRecordCallback(int event, void* user, void *info) {
 void FFmpegOutput::audioRecordCallback(int event, void *info) {
     if (event != 0) return;
 
+    if (!audioThreadSetup) {
+        applyThreadRole(THREAD_AUDIO_CAPTURE);
+        audioThreadSetup = true;
+    }
+
     AudioRecord::Buffer *buffer = (AudioRecord::Buffer*) info;
 
-    pthread_mutex_lock(&inSamplesMutex);
-    for (unsigned int i = 0; i < buffer->frameCount * audioChannels; i++) {
-        inSamples[inSamplesEnd++] = (float)buffer->i16[i] / 32769.0;
-        inSamplesEnd %= inSamplesSize;
-        if (inSamplesEnd == inSamplesStart) {
-            ALOGE("SCR audio buffer overrun");
-            //TODO: handle overrun
-        }
+    // oldest samples are dropped on overrun, see SampleRing
+    audioSync.write(&inSamples, buffer->i16, buffer->frameCount, getTimeUs());
+}
+
+static void staticInternalAudioCallback(int event, void* user, void *info) {
+   FFmpegOutput *output = (FFmpegOutput*)user;
+   output->internalAudioCallback(event, info);
+}
+
+void FFmpegOutput::internalAudioCallback(int event, void *info) {
+    if (event != 0) return;
+
+    if (!internalThreadSetup) {
+        applyThreadRole(THREAD_AUDIO_CAPTURE);
+        internalThreadSetup = true;
     }
-    pthread_mutex_unlock(&inSamplesMutex);
+
+    AudioRecord::Buffer *buffer = (AudioRecord::Buffer*) info;
+    internalSync.write(&internalSamples, buffer->i16, buffer->frameCount, getTimeUs());
 }
 
-inline int FFmpegOutput::availableSamplesCount() {
-    return ((inSamplesSize + inSamplesEnd - inSamplesStart) % inSamplesSize) / audioChannels;
+// Blocks until the given number of input frames is available in inFrame,
+// returns false when audio input was closed.
+bool FFmpegOutput::readAudioInput(int frames) {
+    int count = frames * captureChannels;
+
+    // woken up by the sample ring as soon as enough samples are buffered
+    if (!inSamples.waitAvailable(count)) {
+        return false;
+    }
+
+    int samplesRead = inSamples.read(inFrame, count);
+
+    // pad with silence rather than submitting stale samples
+    if (samplesRead < count) {
+        memset(inFrame + samplesRead, 0, (count - samplesRead) * sizeof(int16_t));
+    }
+
+    if (internalRecordStarted) {
+        mixInternalAudio(count);
+    }
+    return true;
+}
+
+// The microphone drives the timing, internal audio which is late is replaced with silence
+// and the same number of samples is skipped once it arrives to keep both sources aligned.
+void FFmpegOutput::mixInternalAudio(int count) {
+    while (internalDeficit > 0 && internalSamples.available() > 0) {
+        internalDeficit -= internalSamples.read(mixFrame, FFMIN(internalDeficit, count));
+    }
+
+    int samplesRead = internalDeficit > 0 ? 0 : internalSamples.read(mixFrame, count);
+    if (samplesRead < count) {
+        memset(mixFrame + samplesRead, 0, (count - samplesRead) * sizeof(int16_t));
+        internalDeficit += count - samplesRead;
+        internalPadded += count - samplesRead;
+    }
+
+    int64_t startUs = getTimeUs();
+    mixS16(inFrame, micGain / 100.0f, mixFrame, internalGain / 100.0f, inFrame, count);
+    mixTimeUs += getTimeUs() - startUs;
 }
 
-void FFmpegOutput::getAudioFrame()
+// Blocks until a full codec frame is available in outSamples, returns false when audio input was closed.
+bool FFmpegOutput::getAudioFrame()
 {
-    int samplesWritten = 0;
+    if (swr != NULL) {
+        return resampleAudioFrame();
+    }
+
+    if (!readAudioInput(audioFrameSize)) {
+        return false;
+    }
+
+    float *planes[2] = { outSamples, outSamples + audioFrameSize };
+    convertS16ToFltp(inFrame, planes, audioFrameSize, audioChannels);
+    return true;
+}
+
+bool FFmpegOutput::resampleAudioFrame() {
+    while (av_audio_fifo_size(resampleFifo) < audioFrameSize) {
+        if (!readAudioInput(inChunkFrames)) {
+            return false;
+        }
+
+        const uint8_t *in = (const uint8_t*) inFrame;
+        uint8_t *out[2] = { (uint8_t*) resampleBuffer, (uint8_t*) (resampleBuffer + resampleCapacity) };
+
+        int64_t startUs = getTimeUs();
+        int converted = swr_convert(swr, out, resampleCapacity, &in, inChunkFrames);
+        resampleTimeUs += getTimeUs() - startUs;
 
-    pthread_mutex_lock(&inSamplesMutex);
-    while (samplesWritten < audioFrameSize && availableSamplesCount() > 0) {
-        outSamples[samplesWritten] = inSamples[inSamplesStart++];
-        inSamplesStart %= inSamplesSize;
-        if (audioChannels == 2) {
-            outSamples[audioFrameSize + samplesWritten] = inSamples[inSamplesStart++];
-            inSamplesStart %= inSamplesSize;
+        if (converted < 0) {
+            stop(252, "Error resampling audio");
         }
-        samplesWritten++;
+        av_audio_fifo_write(resampleFifo, (void**) out, converted);
     }
-    pthread_mutex_unlock(&inSamplesMutex);
+
+    void *planes[2] = { outSamples, outSamples + audioFrameSize };
+    av_audio_fifo_read(resampleFifo, planes, audioFrameSize);
+    return true;
 }
 
 void FFmpegOutput::writeAudioFrame() {
-    AVCodecContext *c;
     AVPacket pkt;
-    AVFrame *frame = avcodec_alloc_frame();
     int pktReceived, ret;
 
     av_init_packet(&pkt);
-    pkt.data = NULL;    // packet data will be allocated by the encoder
-    pkt.size = 0;
-    c = audioStream->codec;
-
-    getAudioFrame();
+    pkt.data = audioScratch; // copied to the packet arena by writePacket()
+    pkt.size = audioScratchSize;
 
-    frame->nb_samples = audioFrameSize;
-    frame->pts = sampleCount;
+    audioFrame->pts = sampleCount;
     sampleCount += audioFrameSize;
 
-    avcodec_fill_audio_frame(frame, c->channels, c->sample_fmt, (uint8_t *)outSamples,
-                            audioFrameSize * av_get_bytes_per_sample(c->sample_fmt) * c->channels, 1);
-
-    ret = avcodec_encode_audio2(c, &pkt, frame, &pktReceived);
+    ret = avcodec_encode_audio2(audioStream->codec, &pkt, audioFrame, &pktReceived);
     if (ret < 0) {
         stop(238, "Error encoding audio frame");
     }
@@ -283,25 +920,28 @@ void FFmpegOutput::writeAudioFrame() {
     if (pktReceived) {
         pkt.stream_index = audioStream->index;
 
-        pthread_mutex_lock(&outputWriteMutex);
-        /* Write the compressed frame to the media file. */
-        ret = av_interleaved_write_frame(oc, &pkt);
-        pthread_mutex_unlock(&outputWriteMutex);
-        if (ret != 0) {
+        if (writePacket(&pkt) != 0) {
             stop(246, "Error while writing audio frame");
         }
     }
-    avcodec_free_frame(&frame);
     av_free_packet(&pkt);
 }
 
-void FFmpegOutput::writeVideoFrame() {
-    pthread_mutex_lock(&frameEncMutex);
-    videoFrame = frames[frameCount % 2];
-    //fprintf(stderr, "Populate frame %d\n", (videoFrame == frames[0]) ? 0 : 1);fflush(stderr);
+void FFmpegOutput::writeVideoFrame(int64_t captureTimeUs) {
+    // blocks only if the encoder is behind by the whole queue depth
+    AVFrame **slot = frameQueue.beginWrite(true);
+    if (slot == NULL) {
+        return;
+    }
+    AVFrame *videoFrame = *slot;
 
-    int64_t ptsMs = getTimeMs() - startTimeMs;
-    videoFrame->pts = av_rescale_q(ptsMs, (AVRational){1,1000}, videoStream->time_base);
+    // the encoder rejects non increasing timestamps
+    int64_t pts = av_rescale_q(captureTimeUs - startTimeUs, (AVRational){1, 1000000}, videoStream->codec->time_base);
+    if (lastVideoPts != AV_NOPTS_VALUE && pts <= lastVideoPts) {
+        pts = lastVideoPts + 1;
+    }
+    videoFrame->pts = pts;
+    lastVideoPts = pts;
 
     if (inputBase != NULL) {
         if (rotateView) {
@@ -310,23 +950,22 @@ void FFmpegOutput::writeVideoFrame() {
             copyYUVBuf(videoFrame->data, (uint8_t*)inputBase, videoFrame->linesize);
         }
     }
-    //fprintf(stderr, "Frame ready %d\n", (videoFrame == frames[0]) ? 0 : 1);fflush(stderr);
-    pthread_mutex_unlock(&frameReadyMutex);
+    frameQueue.commitWrite();
 }
 
 void* FFmpegOutput::encodingThreadStart(void* args) {
     FFmpegOutput *output = static_cast<FFmpegOutput*>(args);
+    applyThreadRole(THREAD_VIDEO_ENCODER);
     while (1) {
-        pthread_mutex_lock(&output->frameReadyMutex);
-        if (!mrRunning) {
+        // returns NULL once the queue is closed and drained
+        AVFrame **slot = output->frameQueue.beginRead(true);
+        if (slot == NULL) {
             break;
         }
-        AVFrame *f = output->videoFrame;
-        pthread_mutex_unlock(&output->frameEncMutex);
-        //fprintf(stderr, "Encode frame %d\n", (f == frames[0]) ? 0 : 1);fflush(stderr);
-        output->encodeAndSaveVideoFrame(f);
-        //fprintf(stderr, "Frame encoded %d\n", (f == frames[0]) ? 0 : 1);fflush(stderr);
+        output->encodeAndSaveVideoFrame(*slot);
+        output->frameQueue.commitRead();
     }
+    output->flushVideoEncoder();
     pthread_exit(NULL);
     return NULL;
 }
@@ -336,16 +975,26 @@ void FFmpegOutput::encodeAndSaveVideoFrame(AVFrame *frame) {
     int ret, pktReceived;
     AVPacket pkt;
     av_init_packet(&pkt);
-    pkt.data = NULL;    // packet data will be allocated by the encoder
-    pkt.size = 0;
+    pkt.data = videoScratch; // copied to the packet arena by writePacket()
+    pkt.size = videoScratchSize;
 
     /* encode the image */
+    int64_t encodeStartUs = getTimeUs();
     ret = avcodec_encode_video2(videoStream->codec, &pkt, frame, &pktReceived);
     if (ret < 0) {
         stop(239, "Error encoding video frame");
     }
+    int64_t encodeUs = getTimeUs() - encodeStartUs;
+    encodeTimeUs += encodeUs;
+    encodedFrames++;
+    updateEncoderLoad(encodeUs);
+    if (storageMonitor.getLevel() != storageLevel) {
+        storageLevel = storageMonitor.getLevel();
+        setEncoderLoadLevel(loadLevel, "storage");
+    }
 
     if (pktReceived) {
+        encodedBytes += pkt.size;
         //fprintf(stderr, "VIDEO frame %3d (size=%5d)\n", frameCount, pkt.size);
 
         if (videoStream->codec->coded_frame->key_frame)
@@ -353,52 +1002,383 @@ void FFmpegOutput::encodeAndSaveVideoFrame(AVFrame *frame) {
 
         pkt.stream_index = videoStream->index;
 
-        pthread_mutex_lock(&outputWriteMutex);
-        /* Write the compressed frame to the media file. */
-        ret = av_interleaved_write_frame(oc, &pkt);
-        pthread_mutex_unlock(&outputWriteMutex);
-        if (ret != 0) {
+        if (writePacket(&pkt) != 0) {
             stop(240, "Error while writing video frame");
         }
     }
     av_free_packet(&pkt);
 }
 
-void FFmpegOutput::renderFrame() {
-    updateInput();
+// Step encoder effort down when frames pile up in the frame queue, encoding takes most of the frame period
+// or the muxer buffer fills up, and step back up once the pipeline has been keeping up for a while.
+void FFmpegOutput::updateEncoderLoad(int64_t encodeUs) {
+    if (!adaptiveEncoding || !restrictFrameRate) {
+        return;
+    }
+    avgEncodeUs = (avgEncodeUs == 0) ? encodeUs : (avgEncodeUs * 7 + encodeUs) / 8;
+    int64_t framePeriodUs = 1000000 / frameRate;
+    int backlog = frameQueue.size();
+
+    const char *reason = NULL;
+    if (backlog >= frameQueue.getCapacity() - 1) {
+        reason = "frame queue full";
+    } else if (avgEncodeUs > framePeriodUs * 9 / 10) {
+        reason = "encoding too slow";
+    } else if (queuedBytes > muxerBufferSize / 2) {
+        reason = "muxer backlog";
+    }
 
-    writeVideoFrame();
+    if (reason != NULL) {
+        recoveredFrames = 0;
+        if (++overloadedFrames > frameRate / 2 && loadLevel < ENCODER_LOAD_LEVELS - 1) {
+            setEncoderLoadLevel(loadLevel + 1, reason);
+        }
+    } else if (backlog == 0 && avgEncodeUs < framePeriodUs * 6 / 10 && queuedBytes < muxerBufferSize / 4) {
+        overloadedFrames = 0;
+        if (++recoveredFrames > frameRate * 3 && loadLevel > 0) {
+            setEncoderLoadLevel(loadLevel - 1, "recovered");
+        }
+    } else {
+        overloadedFrames = 0;
+        recoveredFrames = 0;
+    }
+}
 
-    while (audioSource != SCR_AUDIO_MUTE && availableSamplesCount() >= audioFrameSize) {
-        writeAudioFrame();
+// Only settings the MPEG-4 encoder reads for every frame are changed so the codec doesn't need to be reopened.
+// B-frame count and motion estimation method are fixed when the codec is opened. The target bitrate is
+// fixed as well, the storage level lowers the bitrate by raising qmin further.
+void FFmpegOutput::setEncoderLoadLevel(int level, const char *reason) {
+    AVCodecContext *c = videoStream->codec;
+    static const int qminStep[ENCODER_LOAD_LEVELS] = { 0, 2, 4, 8 };
+
+    int qmin = FFMIN(baseQmin + qminStep[level] + qminStep[storageLevel], c->qmax);
+    c->qmin = qmin;
+    c->lmin = qmin * FF_QP2LAMBDA;
+    c->me_subpel_quality = (level >= 1) ? FFMIN(preset->subpelQuality, 2) : preset->subpelQuality;
+    c->mb_decision = (level >= 2) ? FF_MB_DECISION_SIMPLE : preset->mbDecision;
+
+    ALOGW("encoder load level %d -> %d (%s), storage level %d, avg encode %lldus, frame queue %d, muxer buffer %d, qmin %d",
+            loadLevel, level, reason, storageLevel, avgEncodeUs, frameQueue.size(), queuedBytes, qmin);
+    loadLevel = level;
+    overloadedFrames = 0;
+    recoveredFrames = 0;
+}
+
+// write frames delayed by B-frame reordering
+void FFmpegOutput::flushVideoEncoder() {
+    if (!(videoStream->codec->codec->capabilities & CODEC_CAP_DELAY)) {
+        return;
+    }
+    while (!muxerAborted) {
+        int pktReceived = 0;
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.data = videoScratch;
+        pkt.size = videoScratchSize;
+
+        if (avcodec_encode_video2(videoStream->codec, &pkt, NULL, &pktReceived) < 0 || !pktReceived) {
+            break;
+        }
+        if (videoStream->codec->coded_frame->key_frame)
+            pkt.flags |= AV_PKT_FLAG_KEY;
+        pkt.stream_index = videoStream->index;
+
+        int ret = writePacket(&pkt);
+        av_free_packet(&pkt);
+        if (ret != 0) {
+            break;
+        }
+    }
+}
+
+void* FFmpegOutput::audioEncodingThreadStart(void* args) {
+    FFmpegOutput *output = static_cast<FFmpegOutput*>(args);
+    applyThreadRole(THREAD_AUDIO_ENCODER);
+    while (output->getAudioFrame()) {
+        output->writeAudioFrame();
     }
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void FFmpegOutput::startMuxer() {
+    if (!videoPackets.init(MUXER_QUEUE_PACKETS) || !audioPackets.init(MUXER_QUEUE_PACKETS)) {
+        stop(234, "Could not allocate packet queues");
+    }
+    // audio takes a small fraction of the muxer buffer
+    if (!videoArena.init(muxerBufferSize) || !audioArena.init(muxerBufferSize / 16)) {
+        stop(234, "Could not allocate packet arena");
+    }
+    if (pthread_create(&muxerThread, NULL, FFmpegOutput::muxerThreadStart, this) != 0) {
+        stop(234, "Can't start muxer thread");
+    }
+    muxerThreadStarted = true;
+}
+
+// Muxer stage shared by the video and audio encoding threads.
+// Copies the packet data from the encoder scratch buffer to the stream packet arena
+// and queues it for the muxer thread.
+int FFmpegOutput::writePacket(AVPacket *pkt) {
+    bool video = (pkt->stream_index == videoStream->index);
+    SpscQueue<AVPacket> *queue = video ? &videoPackets : &audioPackets;
+    PacketArena *arena = video ? &videoArena : &audioArena;
+
+    waitForMuxerSpace(pkt->size);
+
+    AVPacket *slot = queue->beginWrite(true);
+    if (slot == NULL) {
+        // muxer failed, the caller still owns the packet
+        return -1;
+    }
+
+    uint8_t *data = arena->alloc(pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (data != NULL) {
+        memcpy(data, pkt->data, pkt->size);
+        memset(data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        pkt->data = data;
+        pkt->priv = arena;
+        pkt->destruct = releaseArenaPacket;
+    } else if (av_dup_packet(pkt) < 0) {
+        // arena full, fall back to a heap copy
+        return -1;
+    }
+    *slot = *pkt;
+    av_init_packet(pkt);
+    pkt->data = NULL;
+    pkt->size = 0;
+
+    int32_t queued = __sync_add_and_fetch(&queuedBytes, slot->size);
+    if (queued > maxQueuedBytes) {
+        maxQueuedBytes = queued;
+    }
+    queue->commitWrite();
+    packetsQueued.notify();
+    return 0;
+}
+
+// Backpressure: stall the encoder when queued packets exceed the high watermark
+// and let it continue once the muxer drained the queue to half of the buffer size.
+void FFmpegOutput::waitForMuxerSpace(int size) {
+    int highWatermark = (int) ((int64_t) muxerBufferSize * muxerHighWatermark / 100);
+    if (queuedBytes + size <= highWatermark) {
+        return;
+    }
+    __sync_fetch_and_add(&muxerStalls, 1);
+    ALOGW("muxer buffer high watermark reached %d bytes queued", queuedBytes);
+    packetsWritten.beginWait();
+    while (queuedBytes > muxerBufferSize / 2 && !muxerAborted) {
+        packetsWritten.wait();
+    }
+    packetsWritten.endWait();
+}
+
+// called by av_free_packet() on the muxer thread, packets are freed in the order they were queued
+void FFmpegOutput::releaseArenaPacket(AVPacket *pkt) {
+    static_cast<PacketArena*>(pkt->priv)->release(pkt->data);
+    pkt->data = NULL;
+    pkt->size = 0;
+}
+
+void* FFmpegOutput::muxerThreadStart(void* args) {
+    FFmpegOutput *output = static_cast<FFmpegOutput*>(args);
+    applyThreadRole(THREAD_MUXER);
+    output->runMuxer();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void FFmpegOutput::runMuxer() {
+    while (true) {
+        SpscQueue<AVPacket> *queue;
+        AVPacket *pkt = nextMuxerPacket(&queue);
+
+        if (pkt == NULL) {
+            if (muxerClosing) {
+                break;
+            }
+            packetsQueued.beginWait();
+            while (nextMuxerPacket(&queue) == NULL && !muxerClosing) {
+                packetsQueued.wait();
+            }
+            packetsQueued.endWait();
+            continue;
+        }
+
+        int size = pkt->size;
+        bool video = (queue == &videoPackets);
+
+        bool split = storageMonitor.isSplitRequested();
+        if (segmentSizeLimit > 0 || segmentDuration > 0 || split) {
+            updateSegments(pkt, video, split);
+        }
+
+        // each segment starts at zero, the offset is the dts of its first video key frame
+        AVCodecContext *codec = oc->streams[pkt->stream_index]->codec;
+        int64_t offset = av_rescale_q(segment->startDts, videoStream->codec->time_base, codec->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts -= offset;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= offset;
+
+        int ret = 0;
+        if (!video && segment->index > 0 && pkt->dts != AV_NOPTS_VALUE && pkt->dts < 0) {
+            // audio from before the switch which arrived after it, see nextMuxerPacket()
+            lateAudioPackets++;
+            av_free_packet(pkt);
+        } else {
+            // encoders produce timestamps in codec time base, the muxer may have chosen a different one
+            AVStream *st = segment->oc->streams[pkt->stream_index];
+            if (pkt->pts != AV_NOPTS_VALUE)
+                pkt->pts = av_rescale_q(pkt->pts, codec->time_base, st->time_base);
+            if (pkt->dts != AV_NOPTS_VALUE)
+                pkt->dts = av_rescale_q(pkt->dts, codec->time_base, st->time_base);
+            if (pkt->duration > 0)
+                pkt->duration = av_rescale_q(pkt->duration, codec->time_base, st->time_base);
+
+            // packets are already interleaved by dts in nextMuxerPacket(),
+            // av_interleaved_write_frame() would copy them to its own allocated queue
+            int64_t outputPosition = avio_tell(segment->oc->pb);
+            ret = av_write_frame(segment->oc, pkt);
+            if (video && segment->keyframes != NULL && ret == 0) {
+                segment->keyframes->addFrame(pkt->pts, pkt->dts, outputPosition + segment->headerReserve,
+                        avio_tell(segment->oc->pb) - outputPosition, pkt->flags & AV_PKT_FLAG_KEY);
+            }
+            if (segment->journal != NULL && ret == 0) {
+                int ctsOffset = pkt->pts != AV_NOPTS_VALUE ? pkt->pts - pkt->dts : 0;
+                segment->journal->addSample(pkt->stream_index, outputPosition + segment->headerReserve,
+                        avio_tell(segment->oc->pb) - outputPosition,
+                        pkt->dts, ctsOffset, pkt->duration, pkt->flags & AV_PKT_FLAG_KEY);
+            }
+            av_free_packet(pkt);
+
+            // in fragmented mode the muxer writes to the file only when it completes a fragment,
+            // pass it to the kernel right away so that it survives the process being killed
+            if (fragmentDuration > 0 && ret == 0 && avio_tell(segment->oc->pb) != outputPosition) {
+                avio_flush(segment->oc->pb);
+                ret = segment->writer->flush();
+                fragments++;
+            }
+        }
+        queue->commitRead();
+        __sync_fetch_and_sub(&queuedBytes, size);
+        packetsWritten.notify();
+
+        if (ret != 0) {
+            abortMuxer();
+            if (video) {
+                stop(240, "Error while writing video frame");
+            } else {
+                stop(246, "Error while writing audio frame");
+            }
+            break;
+        }
+    }
+}
+
+// Returns the queued packet with the lowest dts to keep the interleaving buffer short.
+// While a segment switch is pending a packet is only taken when the other stream has one queued
+// as well, so audio goes to the segment its dts belongs to whichever encoder is ahead. Holding
+// stops before the encoders could stall on the muxer buffer, e.g. if audio capture stopped.
+AVPacket* FFmpegOutput::nextMuxerPacket(SpscQueue<AVPacket> **queue) {
+    AVPacket *video = videoPackets.beginRead(false);
+    AVPacket *audio = audioPackets.beginRead(false);
+
+    if (switchPending && audioStream != NULL && (video == NULL || audio == NULL) && !muxerClosing
+            && queuedBytes <= muxerBufferSize / 2) {
+        return NULL;
+    }
+
+    if (audio != NULL && (video == NULL || av_compare_ts(audio->dts, audioStream->codec->time_base,
+            video->dts, videoStream->codec->time_base) < 0)) {
+        *queue = &audioPackets;
+        return audio;
+    }
+    *queue = &videoPackets;
+    return video;
+}
+
+// release encoders stalled on a full muxer buffer after a write error
+void FFmpegOutput::abortMuxer() {
+    muxerAborted = true;
+    videoPackets.close();
+    audioPackets.close();
+    packetsWritten.notify();
+}
+
+void FFmpegOutput::renderFrame() {
+    updateInput();
+    int64_t captureTimeUs = getTimeUs();
+
+    writeVideoFrame(captureTimeUs);
 }
 
 void FFmpegOutput::closeOutput(bool fromMainThread) {
     ALOGV("Closing FFmpeg output %d", fromMainThread);
     if (mrRunning) {
         mrRunning = false;
-        pthread_mutex_unlock(&frameReadyMutex);
+        frameQueue.close();
         pthread_join(encodingThread, NULL);
     }
 
+    updateEncoderStats();
+
+    if (audioEncodingThreadStarted) {
+        audioEncodingThreadStarted = false;
+        inSamples.close();
+        internalSamples.close();
+        pthread_join(audioEncodingThread, NULL);
+    }
+
+    if (muxerThreadStarted) {
+        muxerThreadStarted = false;
+        // the muxer writes all queued packets before exiting
+        muxerClosing = true;
+        packetsQueued.notify();
+        if (!pthread_equal(pthread_self(), muxerThread)) {
+            pthread_join(muxerThread, NULL);
+        }
+        ALOGI("muxer buffer max %d bytes, stalls %d, packet arena misses %u video %u audio",
+                maxQueuedBytes, muxerStalls, videoArena.getMisses(), audioArena.getMisses());
+        printf("muxer_buffer %d %d\n", maxQueuedBytes, muxerStalls);
+        printf("packet_arena_misses %u %u\n", videoArena.getMisses(), audioArena.getMisses());
+        if (lateAudioPackets > 0) {
+            ALOGW("%d audio packets from before a segment switch dropped", lateAudioPackets);
+        }
+        if (fragmentDuration > 0) {
+            ALOGI("%d fragments written", fragments);
+            printf("fragments %d\n", fragments);
+        }
+        fflush(stdout);
+    }
+
+    // the monitor must not request a split or a stop while the output is being completed
+    storageMonitor.stop();
+    storageMonitor.printStats();
+
+    if (finalizeThreadStarted) {
+        // previous segments are completed before the last one
+        finalizeThreadStarted = false;
+        finishedSegments.close();
+        pthread_join(finalizeThread, NULL);
+    }
+
     if (oc) {
-        if (oc->pb) {
+        if (segment != NULL) {
             ALOGV("Writing trailer");
-            av_write_trailer(oc);
-            avio_close(oc->pb);
+            closeSegment(segment, true);
+        }
+        if (nextSegment != NULL) {
+            // opened ahead but not used
+            closeSegment(nextSegment, false);
+            unlink(nextSegment->path);
         }
 
         if (videoStream) {
             ALOGV("streams and codecs cleanup");
             avcodec_close(videoStream->codec);
         }
-        /* The process will terminate soon anyway we don't bother freeing this
-        as it requires checking what's allocated to avoid SIGSEGV
-        av_freep(&frames[0]->data[0]);
-        avcodec_free_frame(&frames[0]);
-        av_freep(&frames[1]->data[0]);
-        avcodec_free_frame(&frames[1]); */
+        /* The process will terminate soon anyway we don't bother freeing
+        the frame queue as it requires checking what's allocated to avoid SIGSEGV */
 
 
         /* free the stream */
@@ -409,10 +1389,59 @@ void FFmpegOutput::closeOutput(bool fromMainThread) {
         ALOGV("Stopping audio");
         audioRecord->stop();
         // don't free audioRecord as the destructor causes SIGSEGV on many devices
+
+        ALOGI("audio overruns: %u (%u samples dropped), underruns: %u",
+                inSamples.getOverruns(), inSamples.getDroppedSamples(), inSamples.getUnderruns());
+        printf("audio_overruns %u %u\naudio_underruns %u\n",
+                inSamples.getOverruns(), inSamples.getDroppedSamples(), inSamples.getUnderruns());
+
+        ALOGI("audio drift: %lldms, silence inserted: %lldms, dropped: %lldms, corrected: %lldms",
+                audioSync.getDriftUs() / 1000, audioSync.getSilenceUs() / 1000,
+                audioSync.getDroppedUs() / 1000, audioSync.getCorrectedUs() / 1000);
+        printf("audio_drift %lldms silence %lldms dropped %lldms corrected %lldms\n",
+                audioSync.getDriftUs() / 1000, audioSync.getSilenceUs() / 1000,
+                audioSync.getDroppedUs() / 1000, audioSync.getCorrectedUs() / 1000);
+        if (internalRecordStarted) {
+            internalRecord->stop();
+            int64_t paddedMs = internalPadded * 1000 / (captureRate * captureChannels);
+            ALOGI("internal audio mixed in %lldms, padded with %lldms of silence", mixTimeUs / 1000, paddedMs);
+            printf("audio_mix %lldms %lldms\n", mixTimeUs / 1000, paddedMs);
+        }
+        if (swr != NULL) {
+            ALOGI("audio resampled from %dHz %d channels in %lldms",
+                    captureRate, captureChannels, resampleTimeUs / 1000);
+            printf("audio_resample %d %d %lldms\n", captureRate, captureChannels, resampleTimeUs / 1000);
+        }
+        fflush(stdout);
     }
     ALOGV("FFmpeg output closed");
 }
 
+void FFmpegOutput::updateEncoderStats() {
+    if (encodeTimeUs <= 0) {
+        return;
+    }
+    AVCodecContext *c = videoStream->codec;
+    int64_t durationUs = getTimeUs() - startTimeUs;
+
+    encodeFps = 1000000.0f * encodedFrames / encodeTimeUs;
+    if (durationUs > 0) {
+        encodeBitrate = (int) (encodedBytes * 8 * 1000000 / durationUs);
+    }
+    if (c->flags & CODEC_FLAG_PSNR) {
+        // error[] holds the sum of squared errors of all encoded planes
+        double error = (double) c->error[0] + c->error[1] + c->error[2];
+        double samples = 1.5 * c->width * c->height * encodedFrames;
+        if (error > 0.0) {
+            encodePsnr = (float) (10.0 * log10(255.0 * 255.0 * samples / error));
+        }
+    }
+    ALOGI("encoded %d frames in %lldms using %d threads, preset %s, %.1f fps, %d bps, PSNR %.2f",
+            encodedFrames, encodeTimeUs / 1000, encoderThreads, encoderPreset, encodeFps, encodeBitrate, encodePsnr);
+    printf("encode_fps %f %d\n", encodeFps, encoderThreads);
+    fflush(stdout);
+}
+
 void FFmpegOutput::copyRotateYUVBuf(uint8_t** yuvPixels, uint8_t* screen, int* stride) {
     for (int x = paddingWidth; x < videoWidth - paddingWidth; x++) {
         for (int y = videoHeight - paddingHeight - 1; y >= paddingHeight; y--) {
@@ -2,8 +2,54 @@
 #define SCREENREC_FFMPEG_OUTPUT_H
 
 #include "screenrec.h"
+#include "spsc_queue.h"
+#include "packet_arena.h"
+#include "file_writer.h"
+#include "output_journal.h"
+#include "faststart.h"
+#include "keyframe_index.h"
+#include "storage_monitor.h"
+#include "sample_ring.h"
+#include "audio_sync.h"
+#include "audio_convert.h"
 
 #include <math.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+// max number of packets per stream waiting for the muxer
+#define MUXER_QUEUE_PACKETS 1024
+
+// completed segments waiting for the finalizer thread
+#define FINALIZE_QUEUE_SEGMENTS 4
+
+// FFmpeg IO buffer, its contents are copied to the file writer chunks when full
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+// worst case bytes per macroblock checked by the MPEG-4 encoder (MAX_MB_BYTES in mpegvideo.h)
+#define MPEG4_MAX_MB_BYTES (30 * 16 * 16 * 3 / 8 + 120)
+
+// default segment size on FAT file systems which can't store files of 4GiB or more
+#define FAT_SEGMENT_SIZE (4000ll * 1024 * 1024)
+
+// Video codec time base denominator. MPEG-4 Part 2 allows at most 65535,
+// 60000 is divisible by all common frame rates (15, 24, 25, 30, 48, 50, 60, 100).
+#define VIDEO_TIME_BASE 60000
+
+// MPEG-4 encoder settings trading speed for quality
+struct EncoderPreset {
+    const char *name;
+    int mbDecision;
+    int meMethod;
+    int meRange;
+    int subpelQuality;
+    int maxBFrames;
+    int trellis;
+    int flags;
+};
+
+// Encoder effort levels used when encoding can't keep up, 0 is the selected preset.
+#define ENCODER_LOAD_LEVELS 4
 
 #include <media/AudioRecord.h>
 #include <media/AudioSystem.h>
@@ -16,6 +62,9 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
 }
 
 using namespace android;
@@ -24,77 +73,235 @@ class FFmpegOutput : public ScrOutput {
 public:
     FFmpegOutput()
         : oc(NULL),
-          startTimeMs(0),
+          startTimeUs(0),
           videoStream(NULL),
-          videoFrame(NULL),
+          lastVideoPts(AV_NOPTS_VALUE),
+          encodedFrames(0),
+          encodeTimeUs(0),
+          encodedBytes(0),
+          preset(NULL),
+          baseQmin(2),
+          loadLevel(0),
+          avgEncodeUs(0),
+          overloadedFrames(0),
+          recoveredFrames(0),
+          storageLevel(0),
           audioStream(NULL),
+          videoScratch(NULL),
+          videoScratchSize(0),
           audioFrameSize(0),
           outSamples(NULL),
+          audioFrame(NULL),
+          audioScratch(NULL),
+          audioScratchSize(0),
           sampleCount(0),
           audioRecord(NULL),
           audioRecordStarted(false),
-          inSamplesSize(0),
-          inSamples(NULL),
-          inSamplesStart(0),
-          inSamplesEnd(0) {
-        pthread_mutex_init(&frameReadyMutex, NULL);
-        pthread_mutex_init(&frameEncMutex, NULL);
-        pthread_mutex_init(&outputWriteMutex, NULL);
-        pthread_mutex_init(&inSamplesMutex, NULL);
-        frames[0] = NULL;
-        frames[1] = NULL;
-    }
+          audioThreadSetup(false),
+          audioEncodingThreadStarted(false),
+          inFrame(NULL),
+          captureRate(0),
+          captureChannels(0),
+          swr(NULL),
+          resampleFifo(NULL),
+          resampleBuffer(NULL),
+          resampleCapacity(0),
+          inChunkFrames(0),
+          resampleTimeUs(0),
+          internalRecord(NULL),
+          internalRecordStarted(false),
+          internalThreadSetup(false),
+          mixFrame(NULL),
+          internalDeficit(0),
+          internalPadded(0),
+          mixTimeUs(0),
+          muxerThreadStarted(false),
+          muxerClosing(false),
+          muxerAborted(false),
+          queuedBytes(0),
+          maxQueuedBytes(0),
+          muxerStalls(0),
+          fragments(0),
+          segment(NULL),
+          nextSegment(NULL),
+          segmentSizeLimit(0),
+          switchPending(false),
+          lateAudioPackets(0),
+          finalizeThreadStarted(false) {}
     virtual ~FFmpegOutput() {}
     virtual void setupOutput();
     virtual void renderFrame();
     virtual void closeOutput(bool fromMainThread);
     void audioRecordCallback(int event, void *info);
+    void internalAudioCallback(int event, void *info);
 
 private:
+    friend class PtsTest; // tests/pts_test.cpp
+
+    // Output file. The primary one uses oc, the following segments use copies of its streams.
+    struct OutputSegment {
+        OutputSegment() : oc(NULL), writer(NULL), journal(NULL), keyframes(NULL), path(NULL), index(0), headerReserve(0), startDts(0), durationUs(0), finished(false) {}
+        AVFormatContext *oc;
+        FileWriter *writer;
+        OutputJournal *journal; // sample index for recovery if the file is never completed
+        KeyframeIndex *keyframes; // video frame index sidecar
+        char *path;
+        int index;
+        int headerReserve; // written by the muxer after this offset, see faststart.h
+        int64_t startDts; // video codec time base, subtracted from all packets of the segment
+        int64_t durationUs;
+        bool finished; // the trailer was written and the file closed without errors
+    };
 
     AVFormatContext *oc;
-    int64_t startTimeMs;
+    int64_t startTimeUs;
 
     AVStream *videoStream;
-    AVFrame *videoFrame;
-    AVFrame *frames[2];
+    int64_t lastVideoPts;
+    int encodedFrames;
+    int64_t encodeTimeUs;
+    int64_t encodedBytes;
+
+    static const EncoderPreset presets[];
+    const EncoderPreset *preset;
+
+    // encoder load control
+    int baseQmin;
+    int loadLevel;
+    int64_t avgEncodeUs;
+    int overloadedFrames;
+    int recoveredFrames;
+    int storageLevel; // StorageMonitor level applied to the encoder
+    SpscQueue<AVFrame*> frameQueue; // captured frames waiting for the encoder
+    uint8_t *videoScratch; // encoder output, copied to videoArena
+    int videoScratchSize;
 
     AVStream *audioStream;
     int audioFrameSize;
     float *outSamples;
+    AVFrame *audioFrame;
+    uint8_t *audioScratch; // encoder output, copied to audioArena
+    int audioScratchSize;
     int64_t sampleCount;
 
     AudioRecord *audioRecord;
     bool audioRecordStarted;
-    int inSamplesSize;
-    float *inSamples;
-    int inSamplesStart, inSamplesEnd;
+    bool audioThreadSetup;
+    bool audioEncodingThreadStarted;
+    SampleRing inSamples; // interleaved input samples from AudioRecord
+    AudioSync audioSync;  // aligns input samples with the capture clock
+    int16_t *inFrame;
+
+    // AudioRecord is opened at the device native rate when possible
+    // and converted to the encoder rate and channel count with swresample
+    int captureRate;
+    int captureChannels;
+    SwrContext *swr;
+    AVAudioFifo *resampleFifo;
+    float *resampleBuffer;
+    int resampleCapacity;
+    int inChunkFrames;
+    int64_t resampleTimeUs;
+
+    // internal audio mixed with the microphone for SCR_AUDIO_MIX
+    AudioRecord *internalRecord;
+    bool internalRecordStarted;
+    bool internalThreadSetup;
+    SampleRing internalSamples;
+    AudioSync internalSync;
+    int16_t *mixFrame;
+    int internalDeficit; // samples replaced with silence but not yet received
+    int64_t internalPadded;
+    int64_t mixTimeUs;
 
     pthread_t encodingThread;
-    pthread_mutex_t frameReadyMutex;
-    pthread_mutex_t frameEncMutex;
-    pthread_mutex_t outputWriteMutex;
-    pthread_mutex_t inSamplesMutex;
+    pthread_t audioEncodingThread;
+
+    // muxer stage, encoded packets are written to the file from a separate thread
+    pthread_t muxerThread;
+    bool muxerThreadStarted;
+    SpscQueue<AVPacket> videoPackets;
+    SpscQueue<AVPacket> audioPackets;
+    PacketArena videoArena; // data of packets queued in videoPackets
+    PacketArena audioArena; // data of packets queued in audioPackets
+    QueueEvent packetsQueued;
+    QueueEvent packetsWritten;
+    volatile bool muxerClosing;
+    volatile bool muxerAborted;
+    volatile int32_t queuedBytes;
+    int32_t maxQueuedBytes;
+    int muxerStalls;
+    int fragments;
+
+    // segmented output, the next segment is opened ahead so the switch doesn't wait for the file system
+    OutputSegment *segment;
+    OutputSegment *nextSegment;
+    int64_t segmentSizeLimit;
+    bool switchPending; // a limit was reached, the switch waits for a video key frame
+    int lateAudioPackets;
+
+    // completed segments get their moov atom moved and sidecar files closed off the muxer thread
+    pthread_t finalizeThread;
+    bool finalizeThreadStarted;
+    SpscQueue<OutputSegment*> finishedSegments;
+
+    StorageMonitor storageMonitor;
 
     static void* encodingThreadStart(void* args);
+    static void* audioEncodingThreadStart(void* args);
+    static void* muxerThreadStart(void* args);
+    static void* finalizeThreadStart(void* args);
+    static void releaseArenaPacket(AVPacket *pkt);
     void encodeAndSaveVideoFrame(AVFrame *frame);
+    int writePacket(AVPacket *pkt);
+    void waitForMuxerSpace(int size);
+    AVPacket* nextMuxerPacket(SpscQueue<AVPacket> **queue);
+    void runMuxer();
+    void abortMuxer();
+    void startMuxer();
 
     void loadFFmpegComponents();
     void setupOutputContext();
     void setupVideoStream();
+    int getEncoderThreadCount();
+    void applyEncoderPreset(AVCodecContext *c);
+    void updateEncoderLoad(int64_t encodeUs);
+    void setEncoderLoadLevel(int level, const char *reason);
+    void updateEncoderStats();
     AVFrame * createFrame();
     void setupFrames();
     void setupAudioOutput();
     void setupOutputFile();
+    int openSegment(OutputSegment *s);
+    int getHeaderReserve();
+    int writeSegmentHeader(OutputSegment *s);
+    void startJournal(OutputSegment *s);
+    void startKeyframeIndex(OutputSegment *s);
+    OutputSegment* createSegment(int index);
+    void closeSegment(OutputSegment *s, bool complete);
+    void closeSegmentFile(OutputSegment *s, bool complete);
+    void finishSegment(OutputSegment *s, bool complete);
+    void queueFinishedSegment(OutputSegment *s);
+    void runFinalizer();
+    void updateSegments(AVPacket *pkt, bool video, bool split);
+    static int writeOutput(void *opaque, uint8_t *buf, int size);
+    static int64_t seekOutput(void *opaque, int64_t offset, int whence);
     void startAudioInput();
-    inline int availableSamplesCount();
-    void getAudioFrame();
+    AudioRecord* openAudioRecord(audio_source_t source, int rate, int channels, AudioRecord::callback_t callback);
+    void openInternalAudio();
+    bool readAudioInput(int frames);
+    void mixInternalAudio(int count);
+    void setupResampler();
+    bool getAudioFrame();
+    bool resampleAudioFrame();
     void writeAudioFrame();
-    void writeVideoFrame();
+    void writeVideoFrame(int64_t captureTimeUs);
+    void flushVideoEncoder();
     void copyRotateYUVBuf(uint8_t** yuvPixels, uint8_t* screen, int* stride);
     void copyYUVBuf(uint8_t** yuvPixels, uint8_t* screen, int* stride);
 };
 
 static void staticAudioRecordCallback(int event, void* user, void *info);
+static void staticInternalAudioCallback(int event, void* user, void *info);
 
 #endif
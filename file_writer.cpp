@@ -0,0 +1,295 @@
+#include "file_writer.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+int FileWriter::open(const char *path, int chunkSize, int preallocateStep, int flags) {
+    this->chunkSize = (chunkSize + FILE_WRITER_ALIGN - 1) & ~(FILE_WRITER_ALIGN - 1);
+    this->preallocateStep = preallocateStep;
+    this->flags = flags;
+
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0744);
+    if (fd < 0) {
+        return errno;
+    }
+    if (flags & FILE_WRITER_DIRECT) {
+        // unaligned chunks and header patches still go through the page cache using fd
+        directFd = ::open(path, O_WRONLY | O_DIRECT);
+        if (directFd < 0) {
+            ALOGW("Direct writes not supported %s", strerror(errno));
+        }
+    }
+
+    if (!chunks.init(FILE_WRITER_CHUNKS)) {
+        return ENOMEM;
+    }
+    for (int i = 0; i < FILE_WRITER_CHUNKS; i++) {
+        chunks.slot(i)->data = NULL;
+    }
+    for (int i = 0; i < FILE_WRITER_CHUNKS; i++) {
+        WriteChunk *chunk = chunks.slot(i);
+        void *data = NULL;
+        if (posix_memalign(&data, FILE_WRITER_ALIGN, this->chunkSize) != 0) {
+            freeChunks();
+            return ENOMEM;
+        }
+        chunk->data = (uint8_t*) data;
+        chunk->size = 0;
+        chunk->offset = 0;
+    }
+
+    int ret = pthread_create(&writerThread, NULL, FileWriter::writerThreadStart, this);
+    if (ret != 0) {
+        freeChunks();
+        return ret;
+    }
+    writerThreadStarted = true;
+    return 0;
+}
+
+int FileWriter::write(const uint8_t *buf, int size) {
+    while (size > 0) {
+        if (error) {
+            return error;
+        }
+        if (current == NULL) {
+            // blocks only if all chunks are waiting for the writer thread
+            current = chunks.beginWrite(true);
+            if (current == NULL) {
+                return error ? error : EIO;
+            }
+            current->offset = position;
+            current->size = 0;
+        }
+        // a chunk started at an unaligned position is shortened to end at an aligned one
+        int limit = chunkSize - (int) (current->offset & (FILE_WRITER_ALIGN - 1));
+        int n = limit - current->size;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(current->data + current->size, buf, n);
+        current->size += n;
+        position += n;
+        if (position > fileSize) {
+            fileSize = position;
+        }
+        buf += n;
+        size -= n;
+
+        if (current->size == limit) {
+            submitChunk();
+        }
+    }
+    return 0;
+}
+
+// Returns the new position or -1 on error. Data written so far is submitted
+// and the next write starts a new chunk at the new position.
+int64_t FileWriter::seek(int64_t offset, int whence) {
+    int64_t newPosition;
+    switch (whence) {
+        case SEEK_SET:
+            newPosition = offset;
+            break;
+        case SEEK_CUR:
+            newPosition = position + offset;
+            break;
+        case SEEK_END:
+            newPosition = fileSize + offset;
+            break;
+        default:
+            return -1;
+    }
+    if (newPosition < 0) {
+        return -1;
+    }
+    if (newPosition != position) {
+        submitChunk();
+        position = newPosition;
+    }
+    return position;
+}
+
+int FileWriter::flush() {
+    submitChunk();
+    return error;
+}
+
+void FileWriter::submitChunk() {
+    if (current != NULL && current->size > 0) {
+        chunks.commitWrite();
+        current = NULL;
+    }
+}
+
+int FileWriter::close() {
+    if (fd < 0) {
+        return error;
+    }
+    submitChunk();
+    chunks.close();
+    if (writerThreadStarted) {
+        pthread_join(writerThread, NULL);
+        writerThreadStarted = false;
+    }
+    freeChunks();
+    // release space preallocated past the end of the file
+    if (preallocatedSize > fileSize && ftruncate64(fd, fileSize) < 0) {
+        ALOGW("Can't truncate output file %s", strerror(errno));
+    }
+    if (directFd >= 0) {
+        ::close(directFd);
+        directFd = -1;
+    }
+    if (::close(fd) < 0 && error == 0) {
+        error = errno;
+    }
+    fd = -1;
+    return error;
+}
+
+// chunk buffers are only touched by the producer and the writer thread, which has exited
+void FileWriter::freeChunks() {
+    for (int i = 0; i < chunks.getCapacity(); i++) {
+        WriteChunk *chunk = chunks.slot(i);
+        free(chunk->data);
+        chunk->data = NULL;
+    }
+    current = NULL;
+}
+
+void* FileWriter::writerThreadStart(void* args) {
+    FileWriter *writer = static_cast<FileWriter*>(args);
+    applyThreadRole(THREAD_MUXER);
+    writer->runWriter();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void FileWriter::runWriter() {
+    WriteChunk *chunk;
+    while ((chunk = chunks.beginRead(true)) != NULL) {
+        if (error == 0) {
+            writeChunk(chunk);
+        }
+        chunks.commitRead();
+    }
+}
+
+void FileWriter::writeChunk(WriteChunk *chunk) {
+    preallocate(chunk->offset + chunk->size);
+
+    int64_t startUs = getTimeUs();
+    int written = 0;
+    while (written < chunk->size) {
+        int64_t offset = chunk->offset + written;
+        int size = chunk->size - written;
+        bool direct = directFd >= 0 && ((offset | size) & (FILE_WRITER_ALIGN - 1)) == 0;
+        ssize_t ret = pwrite64(direct ? directFd : fd, chunk->data + written, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (direct && errno == EINVAL) {
+                // e.g. FUSE accepts O_DIRECT in open() but not the writes
+                ALOGW("Direct writes failed, using the page cache");
+                ::close(directFd);
+                directFd = -1;
+                continue;
+            }
+            error = errno;
+            ALOGE("Error writing output file %s", strerror(errno));
+            // wake up the producer blocked on full chunks
+            chunks.close();
+            return;
+        }
+        written += ret;
+        writeCalls++;
+        if (direct) {
+            directBytes += ret;
+        }
+    }
+    if (flags & FILE_WRITER_DROP_CACHE) {
+        // waiting for writeback is storage time as well
+        releaseWritten(chunk->offset, chunk->offset + chunk->size);
+    }
+    int64_t writeUs = getTimeUs() - startUs;
+    writeTimeUs += writeUs;
+    if (writeUs > maxWriteUs) {
+        maxWriteUs = writeUs;
+    }
+    bytesWritten += written;
+    if (monitor != NULL) {
+        monitor->addWrite(written, writeUs);
+    }
+}
+
+// Allocate file extents in large steps ahead of the write position.
+// KEEP_SIZE leaves the file size unchanged so that a crashed recording isn't padded with zeros.
+void FileWriter::preallocate(int64_t end) {
+#if SCR_SDK_VERSION >= 21
+    if (preallocateStep <= 0 || end <= preallocatedSize) {
+        return;
+    }
+    int64_t size = (end / preallocateStep + 1) * preallocateStep;
+    if (fallocate64(fd, FALLOC_FL_KEEP_SIZE, preallocatedSize, size - preallocatedSize) < 0) {
+        // e.g. EOPNOTSUPP on vfat and FUSE
+        ALOGV("Preallocation not supported %s", strerror(errno));
+        preallocateStep = 0;
+        return;
+    }
+    preallocatedSize = size;
+#endif // SCR_SDK_VERSION >= 21
+}
+
+// Once FILE_WRITER_SYNC_SIZE of appended data has accumulated, its writeback is started and the previous
+// region is dropped from the page cache after waiting for it, so the output occupies at most two regions
+// of memory instead of growing the page cache for the whole recording. Data rewritten behind the append
+// position (headers patched by the muxer) is left to the kernel. Failures only leave data cached.
+void FileWriter::releaseWritten(int64_t start, int64_t end) {
+    if (start < appendEnd) {
+        return;
+    }
+    appendEnd = end;
+    if (appendEnd - syncStart < FILE_WRITER_SYNC_SIZE) {
+        return;
+    }
+#if SCR_SDK_VERSION >= 26
+    sync_file_range(fd, syncStart, appendEnd - syncStart, SYNC_FILE_RANGE_WRITE);
+    if (dropEnd > dropStart) {
+        sync_file_range(fd, dropStart, dropEnd - dropStart,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, dropStart, dropEnd - dropStart, POSIX_FADV_DONTNEED);
+        droppedBytes += dropEnd - dropStart;
+    }
+    dropStart = syncStart;
+    dropEnd = appendEnd;
+#elif SCR_SDK_VERSION >= 21
+    // sync_file_range() isn't available in older bionic, wait for all dirty data of the file instead
+    if (fdatasync(fd) == 0) {
+        posix_fadvise(fd, syncStart, appendEnd - syncStart, POSIX_FADV_DONTNEED);
+        droppedBytes += appendEnd - syncStart;
+    }
+#endif // SCR_SDK_VERSION
+    syncStart = appendEnd;
+    syncs++;
+}
+
+void FileWriter::printStats() {
+    float throughput = writeTimeUs > 0 ? (float) bytesWritten / writeTimeUs : 0.0f;
+    ALOGI("written %lld bytes in %d calls, %lldms, max %lldms, %.1fMB/s, preallocated %lld bytes",
+            bytesWritten, writeCalls, writeTimeUs / 1000, maxWriteUs / 1000, throughput, preallocatedSize);
+    printf("file_writer %lld %d %lldms %lldms %.1fMB/s\n",
+            bytesWritten, writeCalls, writeTimeUs / 1000, maxWriteUs / 1000, throughput);
+    if (flags != 0) {
+        ALOGI("page cache released %lld bytes in %d syncs, %lld bytes written directly", droppedBytes, syncs, directBytes);
+        printf("file_writer_cache %lld %d %lld\n", droppedBytes, syncs, directBytes);
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,136 @@
+#ifndef SCREENREC_FILE_WRITER_H
+#define SCREENREC_FILE_WRITER_H
+
+#include "screenrec.h"
+#include "spsc_queue.h"
+#include "storage_monitor.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// number of chunks filled by the producer while the writer thread writes the others
+#define FILE_WRITER_CHUNKS 4
+// chunk buffers are aligned to this so that they map to whole pages and storage blocks
+#define FILE_WRITER_ALIGN 4096
+// written data is synced and dropped from the page cache in regions of this size
+#define FILE_WRITER_SYNC_SIZE (8 * 1024 * 1024)
+
+// open() flags
+#define FILE_WRITER_DROP_CACHE 1 // don't keep written data in the page cache
+#define FILE_WRITER_DIRECT 2 // write aligned chunks with O_DIRECT
+
+struct WriteChunk {
+    uint8_t *data;
+    int size;
+    int64_t offset;
+};
+
+// Buffered output file written in large aligned chunks by a separate thread.
+// The producer appends data at the current position, a full chunk is handed to the writer thread
+// which stores it with pwrite() so seeking back (e.g. to patch a header) just starts a new chunk.
+// File space is preallocated ahead of the write position to reduce fragmentation.
+// Chunks end at FILE_WRITER_ALIGN boundaries so that after a seek only the first one is unaligned.
+class FileWriter {
+public:
+    FileWriter()
+        : fd(-1),
+          directFd(-1),
+          flags(0),
+          chunkSize(0),
+          preallocateStep(0),
+          current(NULL),
+          position(0),
+          fileSize(0),
+          preallocatedSize(0),
+          writerThreadStarted(false),
+          error(0),
+          bytesWritten(0),
+          writeCalls(0),
+          writeTimeUs(0),
+          maxWriteUs(0),
+          appendEnd(0),
+          syncStart(0),
+          dropStart(0),
+          dropEnd(0),
+          syncs(0),
+          droppedBytes(0),
+          directBytes(0),
+          monitor(NULL) {}
+
+    ~FileWriter() {
+        freeChunks();
+    }
+
+    // returns errno on failure, flags are FILE_WRITER_DROP_CACHE and FILE_WRITER_DIRECT
+    int open(const char *path, int chunkSize, int preallocateStep, int flags);
+
+    // producer side, return 0 or the error of a failed write
+    int write(const uint8_t *buf, int size);
+    int64_t seek(int64_t offset, int whence);
+    int flush();
+    int close();
+
+    int64_t getPosition() {
+        return position;
+    }
+
+    int64_t getSize() {
+        return fileSize;
+    }
+
+    int getError() {
+        return error;
+    }
+
+    // write sizes and times are reported to the monitor from the writer thread
+    void setMonitor(StorageMonitor *monitor) {
+        this->monitor = monitor;
+    }
+
+    void printStats();
+
+private:
+    int fd;
+    int directFd; // O_DIRECT descriptor of the same file, -1 if not used
+    int flags;
+    int chunkSize;
+    int preallocateStep;
+
+    SpscQueue<WriteChunk> chunks;
+    WriteChunk *current;
+    int64_t position;
+    int64_t fileSize;
+    int64_t preallocatedSize;
+
+    pthread_t writerThread;
+    bool writerThreadStarted;
+    volatile int error;
+
+    // writer thread statistics
+    int64_t bytesWritten;
+    int writeCalls;
+    int64_t writeTimeUs;
+    int64_t maxWriteUs;
+
+    // page cache release, the end of sequentially appended data, the region
+    // handed to writeback and the previous region to be dropped once written
+    int64_t appendEnd;
+    int64_t syncStart;
+    int64_t dropStart;
+    int64_t dropEnd;
+    int syncs;
+    int64_t droppedBytes;
+    int64_t directBytes;
+
+    StorageMonitor *monitor;
+
+    static void* writerThreadStart(void* args);
+    void runWriter();
+    void writeChunk(WriteChunk *chunk);
+    void preallocate(int64_t end);
+    void releaseWritten(int64_t start, int64_t end);
+    void submitChunk();
+    void freeChunks();
+};
+
+#endif
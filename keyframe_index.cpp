@@ -0,0 +1,123 @@
+#include "keyframe_index.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int KeyframeIndex::open(const char *mediaPath, int timeScale) {
+    snprintf(path, sizeof(path), "%s" KEYFRAME_INDEX_SUFFIX, mediaPath);
+    // readable like the media file after fixFilePermissions()
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) {
+        return errno;
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KEYFRAME_INDEX_MAGIC, sizeof(header.magic));
+    header.timeScale = timeScale;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        int ret = errno ? errno : EIO;
+        close();
+        unlink(path);
+        return ret;
+    }
+
+    // one GOP per second for 10 minutes before the table has to grow
+    gopCapacity = 600;
+    gops = (IndexGop*) malloc(gopCapacity * sizeof(IndexGop));
+    if (gops == NULL) {
+        close();
+        unlink(path);
+        return ENOMEM;
+    }
+    return 0;
+}
+
+void KeyframeIndex::addFrame(int64_t pts, int64_t dts, int64_t offset, int size, bool key) {
+    if (fd < 0) {
+        return;
+    }
+    IndexFrame *frame = &buffer[bufferedFrames++];
+    frame->pts = pts;
+    frame->dts = dts;
+    frame->offset = offset;
+    frame->size = size;
+    frame->flags = key ? KEYFRAME_INDEX_KEY : 0;
+
+    if (key || gopCount == 0) {
+        if (gopCount == gopCapacity) {
+            IndexGop *grown = (IndexGop*) realloc(gops, gopCapacity * 2 * sizeof(IndexGop));
+            if (grown == NULL) {
+                ALOGE("Can't grow keyframe index");
+                close();
+                return;
+            }
+            gops = grown;
+            gopCapacity *= 2;
+        }
+        IndexGop *gop = &gops[gopCount++];
+        gop->pts = pts;
+        gop->offset = offset;
+        gop->firstFrame = frameCount;
+        gop->frameCount = 0;
+        gop->size = 0;
+    }
+    IndexGop *gop = &gops[gopCount - 1];
+    gop->frameCount++;
+    gop->size += size;
+    frameCount++;
+
+    if (bufferedFrames == KEYFRAME_INDEX_BUFFER_FRAMES && flushFrames() != 0) {
+        ALOGE("Error writing keyframe index %s", strerror(errno));
+        close();
+    }
+}
+
+int KeyframeIndex::flushFrames() {
+    int size = bufferedFrames * sizeof(IndexFrame);
+    bufferedFrames = 0;
+    if (write(fd, buffer, size) != size) {
+        return errno ? errno : EIO;
+    }
+    return 0;
+}
+
+int KeyframeIndex::finish(int64_t offsetShift) {
+    if (fd < 0) {
+        return EBADF;
+    }
+    int ret = flushFrames();
+    if (ret != 0) {
+        return ret;
+    }
+
+    IndexFooter footer;
+    footer.gopCount = gopCount;
+    footer.frameCount = frameCount;
+    memcpy(footer.magic, KEYFRAME_INDEX_FOOTER_MAGIC, sizeof(footer.magic));
+    int gopsSize = gopCount * sizeof(IndexGop);
+    if (write(fd, gops, gopsSize) != gopsSize || write(fd, &footer, sizeof(footer)) != sizeof(footer)) {
+        return errno ? errno : EIO;
+    }
+    if (offsetShift != 0 && pwrite(fd, &offsetShift, sizeof(offsetShift), offsetof(IndexHeader, offsetShift))
+            != sizeof(offsetShift)) {
+        return errno ? errno : EIO;
+    }
+    return 0;
+}
+
+void KeyframeIndex::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void KeyframeIndex::printStats() {
+    ALOGI("keyframe index frames:%u gops:%u", frameCount, gopCount);
+    printf("keyframe_index %u %u\n", frameCount, gopCount);
+    fflush(stdout);
+}
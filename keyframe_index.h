@@ -0,0 +1,94 @@
+#ifndef SCREENREC_KEYFRAME_INDEX_H
+#define SCREENREC_KEYFRAME_INDEX_H
+
+#include "screenrec.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// index file name is the output file name with this suffix
+#define KEYFRAME_INDEX_SUFFIX ".idx"
+#define KEYFRAME_INDEX_MAGIC "SCRIDX01"
+#define KEYFRAME_INDEX_FOOTER_MAGIC "SCRIDXGP"
+
+// frames buffered in memory between index writes
+#define KEYFRAME_INDEX_BUFFER_FRAMES 256
+
+#define KEYFRAME_INDEX_KEY 1
+
+// Index layout: IndexHeader, one IndexFrame per video frame in decoding order, then when the
+// recording is complete one IndexGop per key frame and the IndexFooter at the very end.
+// An index without the footer (killed recording) still has all frames written before the crash.
+// Values are little endian as written by ARM and x86 devices.
+struct IndexHeader {
+    char magic[8];
+    uint32_t timeScale; // units of pts and dts per second
+    uint32_t reserved;
+    int64_t offsetShift; // to be added to all offsets, set if the media data was moved after recording
+};
+
+struct IndexFrame {
+    int64_t pts;
+    int64_t dts;
+    int64_t offset; // of the frame data in the output file
+    uint32_t size;
+    uint32_t flags;
+};
+
+struct IndexGop {
+    int64_t pts; // of the key frame
+    int64_t offset;
+    uint32_t firstFrame; // IndexFrame number of the key frame
+    uint32_t frameCount;
+    int64_t size; // bytes of all frames of the GOP
+};
+
+struct IndexFooter {
+    uint32_t gopCount;
+    uint32_t frameCount;
+    char magic[8];
+};
+
+// Binary sidecar with the position and size of every video frame and a key frame table so that
+// seeking, trimming and preview tools don't have to demux the recording.
+class KeyframeIndex {
+public:
+    KeyframeIndex()
+        : fd(-1),
+          bufferedFrames(0),
+          frameCount(0),
+          gops(NULL),
+          gopCount(0),
+          gopCapacity(0) {
+        path[0] = '\0';
+    }
+
+    ~KeyframeIndex() {
+        free(gops);
+    }
+
+    // returns errno on failure
+    int open(const char *mediaPath, int timeScale);
+    void addFrame(int64_t pts, int64_t dts, int64_t offset, int size, bool key);
+    // writes the key frame table, offsetShift is added by readers to all offsets
+    int finish(int64_t offsetShift);
+    void close();
+
+    void printStats();
+
+private:
+    int fd;
+    char path[PATH_MAX];
+    IndexFrame buffer[KEYFRAME_INDEX_BUFFER_FRAMES];
+    int bufferedFrames;
+    uint32_t frameCount;
+
+    IndexGop *gops;
+    uint32_t gopCount;
+    uint32_t gopCapacity;
+
+    int flushFrames();
+};
+
+#endif
@@ -8,14 +8,27 @@ int startRecording(char *config) {
 
     parseConfig(config);
 
+    setupThreadRoles();
+    applyThreadRole(THREAD_CAPTURE);
+
     setupInput();
     adjustRotation();
 
+    // static screens are detected from the captured pixels
+    if (idleFrameRate > 0 && !inputChecksumSupported()) {
+        ALOGW("idle mode is not supported with %s input", useOes ? "OES" : useFb ? "framebuffer" : "screenshot");
+        idleFrameRate = 0;
+    }
+
     printf("rotateView %d verticalInput %d rotation %d\n", rotateView, inputHeight > inputWidth ? 1 : 0, rotation);
     fflush(stdout);
 
     createOutputDir();
 
+    if (writeProbe > 0) {
+        applyWriteProbe(writeProbe, writeProbeCap);
+    }
+
     if (videoEncoder >= 0) {
         if (useGl) {
             output = new GLMediaRecorderOutput();
@@ -34,13 +47,22 @@ int startRecording(char *config) {
     shellSetState("RECORDING");
 
     startTime = getTimeMs();
+    frameTimeBase = startTime;
+    lastChangeTime = startTime;
 
     while (mrRunning && !finished) {
-        if (restrictFrameRate) {
+        if (restrictFrameRate || idle) {
             waitForNextFrame();
         }
         frameCount++;
+        lastFrameTime = getTimeMs();
+        if (frameCount == ALLOC_WARMUP_FRAMES) {
+            warmupAllocations = getAllocationCount();
+        }
         output->renderFrame();
+        if (idleFrameRate > 0) {
+            updateIdleState();
+        }
     }
 
     int recordingTime = getTimeMs() - startTime;
@@ -49,14 +71,23 @@ int startRecording(char *config) {
         fps = 1000.0f * frameCount / recordingTime;
     }
     printf("fps %f\n", fps);
+    if (warmupAllocations >= 0) {
+        int64_t allocations = getAllocationCount() - warmupAllocations;
+        ALOGI("%lld allocations in %d frames after warm-up", allocations, frameCount - ALLOC_WARMUP_FRAMES);
+        printf("allocations %lld %d\n", allocations, frameCount - ALLOC_WARMUP_FRAMES);
+    }
+    if (idleFrameRate > 0) {
+        printIdleStats(recordingTime);
+    }
     fflush(stdout);
 
     if (testMode) {
         if (errorCode != 0) {
             fps = 0.0f;
         }
-        //TODO: use params instead of argv
-        //fprintf(stderr, "%ld, %4sx%s, %6s, %s, %2s, %4.1f\n", (long int)time(NULL), argv[1], argv[2], argv[3], argv[4], argv[5], fps);
+        fprintf(stderr, "%ld, %4dx%d, %8d, %s, %2d, %s, %2d, %9s, %5.1f, %8d, %5.2f, %4.1f\n", (long int)time(NULL), videoWidth, videoHeight,
+                videoBitrate, useGl ? "GPU" : "CPU", videoEncoder, getThreadPlacement(), encoderThreads, encoderPreset,
+                encodeFps, encodeBitrate, encodePsnr, fps);
         fflush(stderr);
     }
 
@@ -78,14 +109,18 @@ void parseConfig(const char* config) {
     char colorFormat[8];
     int vertical;
 
-    int scanned = sscanf(config, "%d %c %d %d %d %d %d %7s %7s %d %d %d %d %d",
+    int optionsPos = 0;
+
+    int scanned = sscanf(config, "%d %c %d %d %d %d %d %7s %7s %d %d %d %d %d%n",
             &rotation, &audioSource, &reqWidth, &reqHeight, &paddingWidth, &paddingHeight, &frameRate, mode,
-            colorFormat, &videoBitrate, &audioSamplingRate, &audioChannels, &videoEncoder, &vertical);
+            colorFormat, &videoBitrate, &audioSamplingRate, &audioChannels, &videoEncoder, &vertical, &optionsPos);
 
     if (scanned != 14) {
         stop(195, true, "params parse error");
     }
 
+    parseOptions(config + optionsPos);
+
     if (frameRate == -1) {
         restrictFrameRate = false;
         frameRate = FRAME_RATE;
@@ -113,8 +148,104 @@ void parseConfig(const char* config) {
         useOes = false;
     }
 
-    ALOGI("SETTINGS rotation: %d, audioSource: %c, sampling: %d, channels: %d, resolution: %d x %d, padding: %d x %d, frameRate: %d, mode: %s, colorFix: %d, videoEncoder: %d, verticalFrames: %d",
-            rotation, audioSource, audioSamplingRate, audioChannels, reqWidth, reqHeight, paddingWidth, paddingHeight, frameRate, useGl ? "GPU" : "CPU", useBGRA, videoEncoder, allowVerticalFrames);
+    if (idleFrameRate >= frameRate) {
+        idleFrameRate = 0;
+    }
+
+    ALOGI("SETTINGS rotation: %d, audioSource: %c, sampling: %d, channels: %d, resolution: %d x %d, padding: %d x %d, frameRate: %d, mode: %s, colorFix: %d, videoEncoder: %d, verticalFrames: %d, idleFrameRate: %d",
+            rotation, audioSource, audioSamplingRate, audioChannels, reqWidth, reqHeight, paddingWidth, paddingHeight, frameRate, useGl ? "GPU" : "CPU", useBGRA, videoEncoder, allowVerticalFrames, idleFrameRate);
+}
+
+// optional "key=value" parameters placed between the fixed parameters and the output name
+void parseOptions(const char* options) {
+    char key[32];
+    char value[32];
+    int consumed;
+
+    while (options < outputName && sscanf(options, " %31[^= /]=%31s%n", key, value, &consumed) == 2) {
+        options += consumed;
+        parseOption(key, value);
+    }
+}
+
+void parseOption(const char* key, const char* value) {
+    if (strcmp(key, "idle") == 0) {
+        idleFrameRate = atoi(value);
+    } else if (strcmp(key, "frame_queue") == 0) {
+        frameQueueDepth = atoi(value);
+        if (frameQueueDepth < 2) {
+            frameQueueDepth = 2;
+        } else if (frameQueueDepth > 16) {
+            frameQueueDepth = 16;
+        }
+    } else if (strcmp(key, "mux_buffer") == 0) {
+        muxerBufferSize = atoi(value) * 1024;
+        if (muxerBufferSize < 512 * 1024) {
+            muxerBufferSize = 512 * 1024;
+        }
+    } else if (strcmp(key, "mux_watermark") == 0) {
+        muxerHighWatermark = atoi(value);
+        if (muxerHighWatermark < 10 || muxerHighWatermark > 100) {
+            muxerHighWatermark = 90;
+        }
+    } else if (strcmp(key, "gop") == 0) {
+        keyframeInterval = atoi(value);
+        if (keyframeInterval < 1) {
+            keyframeInterval = 1;
+        }
+    } else if (strcmp(key, "enc_threads") == 0) {
+        encoderThreads = atoi(value);
+    } else if (strcmp(key, "preset") == 0) {
+        strncpy(encoderPreset, value, sizeof(encoderPreset) - 1);
+    } else if (strcmp(key, "adaptive") == 0) {
+        adaptiveEncoding = atoi(value) != 0;
+    } else if (strcmp(key, "capture_rate") == 0) {
+        audioCaptureRate = atoi(value);
+    } else if (strcmp(key, "mic_gain") == 0) {
+        micGain = atoi(value);
+    } else if (strcmp(key, "internal_gain") == 0) {
+        internalGain = atoi(value);
+    } else if (strcmp(key, "write_chunk") == 0) {
+        writeChunkSize = atoi(value) * 1024;
+        if (writeChunkSize < 64 * 1024) {
+            writeChunkSize = 64 * 1024;
+        } else if (writeChunkSize > 16 * 1024 * 1024) {
+            writeChunkSize = 16 * 1024 * 1024;
+        }
+    } else if (strcmp(key, "prealloc") == 0) {
+        preallocateSize = atoi(value) * 1024 * 1024;
+    } else if (strcmp(key, "cache_drop") == 0) {
+        dropWriteCache = atoi(value) != 0;
+    } else if (strcmp(key, "direct_io") == 0) {
+        directWrites = atoi(value) != 0;
+    } else if (strcmp(key, "frag") == 0) {
+        fragmentDuration = atoi(value);
+    } else if (strcmp(key, "segment_size") == 0) {
+        segmentSize = atoi(value);
+    } else if (strcmp(key, "segment_time") == 0) {
+        segmentDuration = atoi(value);
+    } else if (strcmp(key, "faststart") == 0) {
+        faststartReserve = atoi(value) < 0 ? -1 : atoi(value) * 1024;
+    } else if (strcmp(key, "index") == 0) {
+        keyframeIndex = atoi(value) != 0;
+    } else if (strcmp(key, "journal") == 0) {
+        outputJournal = atoi(value) != 0;
+    } else if (strcmp(key, "storage_monitor") == 0) {
+        storageMonitorInterval = atoi(value);
+    } else if (strcmp(key, "probe") == 0) {
+        writeProbe = atoi(value);
+        if (writeProbe < 0 || writeProbe > 100) {
+            writeProbe = 0;
+        }
+    } else if (strcmp(key, "probe_cap") == 0) {
+        writeProbeCap = atoi(value) != 0;
+    } else if (strcmp(key, "test") == 0) {
+        testMode = atoi(value) != 0;
+    } else if (parseThreadRoleOption(key, value)) {
+        // handled by thread_roles
+    } else {
+        ALOGW("unknown option %s=%s", key, value);
+    }
 }
 
 void initializeTransformation(char *transformation) {
@@ -231,18 +362,88 @@ const char* getThreadName() {
 
 void waitForNextFrame() {
     int64_t now = getTimeMs();
-    int64_t sleepTime = startTime + (frameCount * 1000l / frameRate) - now;
+    int64_t sleepTime;
+    if (idle) {
+        sleepTime = lastFrameTime + 1000l / idleFrameRate - now;
+    } else {
+        sleepTime = frameTimeBase + ((frameCount - frameCountBase) * 1000l / frameRate) - now;
+    }
     if (sleepTime > 0) {
         usleep(sleepTime * 1000);
     }
 }
 
+// Drop to idleFrameRate after the screen content has been static for IDLE_DELAY_MS
+// and return to the full frame rate as soon as a probe frame differs.
+void updateIdleState() {
+    if (inputBase == NULL) {
+        return;
+    }
+    int64_t now = getTimeMs();
+    uint32_t checksum = inputChecksum();
+
+    if (checksum != lastChecksum) {
+        lastChecksum = checksum;
+        lastChangeTime = now;
+        if (idle) {
+            exitIdle(now);
+        }
+    } else if (!idle && now - lastChangeTime > IDLE_DELAY_MS) {
+        enterIdle(now);
+    }
+}
+
+void enterIdle(int64_t now) {
+    ALOGV("static screen detected, entering idle mode");
+    idle = true;
+    idleStartTime = now;
+    idleStartCpu = getCpuTimeMs();
+}
+
+void exitIdle(int64_t now) {
+    ALOGV("screen changed, leaving idle mode");
+    idle = false;
+    idleTime += now - idleStartTime;
+    idleCpu += getCpuTimeMs() - idleStartCpu;
+
+    // restart frame scheduling from the current frame so that we don't try to catch up on skipped frames
+    frameTimeBase = now;
+    frameCountBase = frameCount;
+}
+
+void printIdleStats(int recordingTime) {
+    if (idle) {
+        exitIdle(getTimeMs());
+    }
+    int64_t activeTime = recordingTime - idleTime;
+    int64_t activeCpu = getCpuTimeMs() - idleCpu;
+    int64_t cpuSaved = 0ll;
+    if (activeTime > 0 && idleTime > 0) {
+        // CPU time the idle periods would have taken at the active CPU usage rate
+        cpuSaved = activeCpu * idleTime / activeTime - idleCpu;
+    }
+    ALOGI("idle time %lldms cpu saved %lldms", idleTime, cpuSaved);
+    printf("idle %lldms cpu_saved %lldms\n", idleTime, cpuSaved);
+}
+
 int64_t getTimeMs() {
     timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
     return now.tv_sec * 1000l + now.tv_nsec / 1000000l;
 }
 
+int64_t getTimeUs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ll + now.tv_nsec / 1000l;
+}
+
+int64_t getCpuTimeMs() {
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000l + now.tv_nsec / 1000000l;
+}
+
 bool fixOutputName() {
     // replace /mnt/shell/emulated with /storage/emulated
     // workaround for storage mapping bug on i_style_7_5
@@ -3,6 +3,7 @@
 
 #include "screenrec.h"
 #include "mediarecorder_output.h"
+#include "storage_probe.h"
 #ifdef SCR_FFMPEG
 #include "ffmpeg_output.h"
 #endif
@@ -50,10 +51,41 @@ bool useYUV_SP = false;
 int videoEncoder = 0;
 bool allowVerticalFrames = true;
 
+// Optional parameters
+int idleFrameRate = 0; // capture rate used while the screen is static, 0 disables idle mode
+int frameQueueDepth = 3; // FFmpeg frames buffered between capture and encoder
+int muxerBufferSize = 8 * 1024 * 1024; // max bytes of encoded packets waiting for the FFmpeg muxer
+int muxerHighWatermark = 90; // percent of muxerBufferSize at which encoders are stalled
+int keyframeInterval = 1; // seconds between FFmpeg key frames
+int encoderThreads = 0; // FFmpeg encoder slice threads, 0 to size automatically
+char encoderPreset[16] = "balanced"; // FFmpeg encoder speed preset
+bool adaptiveEncoding = true; // lower FFmpeg encoder effort when it can't keep up
+int audioCaptureRate = 0; // AudioRecord rate tried first by FFmpeg output, 0 for device native rates
+int micGain = 100; // percent, applied when mixing microphone with internal audio
+int internalGain = 100; // percent, applied when mixing microphone with internal audio
+int writeChunkSize = 1024 * 1024; // bytes written to the FFmpeg output file at once
+int preallocateSize = 32 * 1024 * 1024; // FFmpeg output file space allocated ahead, 0 disables
+bool dropWriteCache = true; // keep written FFmpeg output out of the page cache
+bool directWrites = false; // write FFmpeg output with O_DIRECT where the file system supports it
+int fragmentDuration = 0; // max seconds per fragment of FFmpeg fragmented MP4 output, 0 for regular MP4
+int segmentSize = 0; // MiB per FFmpeg output segment, 0 for no size limit (4000 on FAT)
+int segmentDuration = 0; // seconds per FFmpeg output segment, 0 for no time limit
+int faststartReserve = -1; // space reserved for the moov atom at the start of FFmpeg MP4 output, -1 sizes it for the segment length, 0 disables
+bool keyframeIndex = true; // write a .idx sidecar with video frame positions next to regular (not fragmented) FFmpeg MP4 output
+bool outputJournal = true; // write a journal to recover FFmpeg MP4 output of killed recordings
+int storageMonitorInterval = 1; // seconds between FFmpeg output storage readings, 0 disables the monitor
+int writeProbe = 0; // percent of the measured storage write speed the bitrate may use, 0 disables the probe
+bool writeProbeCap = true; // lower videoBitrate to the probe result, otherwise only report it
+
 // Output
 int outputFd;
 int videoWidth, videoHeight;
 
+// statistics
+float encodeFps = -1.0f;
+int encodeBitrate = -1;
+float encodePsnr = -1.0f; // measured only in test mode
+
 // global state
 volatile bool finished = false;
 bool stopping = false;
@@ -72,13 +104,37 @@ pthread_t stoppingThread;
 
 // frame timers
 long uLastFrame = -1;
+int64_t frameTimeBase = 0ll;
+int frameCountBase = 0;
+int64_t lastFrameTime = 0ll;
+
+// allocations are counted after the warm-up when built with SCR_ALLOC_DEBUG
+#define ALLOC_WARMUP_FRAMES 60
+int64_t warmupAllocations = -1;
+
+// idle mode
+#define IDLE_DELAY_MS 1000
+bool idle = false;
+uint32_t lastChecksum = 0;
+int64_t lastChangeTime = 0ll;
+int64_t idleStartTime = 0ll;
+int64_t idleStartCpu = 0ll;
+int64_t idleTime = 0ll;
+int64_t idleCpu = 0ll;
 
 void parseConfig(const char* config);
+void parseOptions(const char* options);
+void parseOption(const char* key, const char* value);
 void initializeTransformation(char* transform);
 void closeOutput();
 void closeInput();
 void adjustRotation();
 void waitForNextFrame();
+void updateIdleState();
+void enterIdle(int64_t now);
+void exitIdle(int64_t now);
+void printIdleStats(int recordingTime);
+int64_t getCpuTimeMs();
 void sigIntHandler(int param __unused);
 void fixFilePermissions();
 const char* getThreadName();
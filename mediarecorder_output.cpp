@@ -190,6 +190,7 @@ void AbstractMediaRecorderOutput::stopMediaRecorder() {
 
 void* AbstractMediaRecorderOutput::stoppingThreadStart(void* args) {
     ALOGV("stoppingThreadStart");
+    applyThreadRole(THREAD_STOPPING);
     AbstractMediaRecorderOutput* output = static_cast<AbstractMediaRecorderOutput*>(args);
     output->stopMediaRecorder();
     return NULL;
@@ -547,7 +548,7 @@ void CPUMediaRecorderOutput::renderFrame() {
         return;
     }
 
-    sp<GraphicBuffer> buf(new GraphicBuffer(anb, false));
+    sp<GraphicBuffer> buf = getGraphicBuffer(anb);
 
     #if SCR_SDK_VERSION < 17
     mANW->lockBuffer(mANW.get(), buf->getNativeBuffer());
@@ -571,6 +572,32 @@ void CPUMediaRecorderOutput::renderFrame() {
     }
 }
 
+// The wrapper holds a reference to anb so the pointer can't be reused for a different buffer
+// while it's cached, the handle is compared anyway in case the slot was reallocated.
+sp<GraphicBuffer> CPUMediaRecorderOutput::getGraphicBuffer(ANativeWindowBuffer* anb) {
+    for (int i = 0; i < cachedBufferCount; i++) {
+        if (cachedAnbs[i] == anb && cachedBuffers[i]->handle == anb->handle) {
+            return cachedBuffers[i];
+        }
+    }
+
+    if (cachedBufferCount == GRAPHIC_BUFFER_CACHE_SIZE) {
+        // only happens if the buffer queue reallocated its buffers, drop the stale wrappers
+        clearGraphicBufferCache();
+    }
+    sp<GraphicBuffer> buf(new GraphicBuffer(anb, false));
+    cachedAnbs[cachedBufferCount] = anb;
+    cachedBuffers[cachedBufferCount++] = buf;
+    return buf;
+}
+
+void CPUMediaRecorderOutput::clearGraphicBufferCache() {
+    for (int i = 0; i < cachedBufferCount; i++) {
+        cachedBuffers[i].clear();
+    }
+    cachedBufferCount = 0;
+}
+
 void CPUMediaRecorderOutput::fillBuffer(sp<GraphicBuffer> buf) {
     uint32_t* bufPixels = NULL;
     uint32_t* screen = (uint32_t*) inputBase;
@@ -695,6 +722,7 @@ void CPUMediaRecorderOutput::copyYUVBuf(uint8_t* yuvPixels, uint8_t* screen, int
 
 void CPUMediaRecorderOutput::closeOutput(bool fromMainThread) {
     AbstractMediaRecorderOutput::closeOutput(fromMainThread);
+    clearGraphicBufferCache();
     if (mANW.get() != NULL) {
         #if SCR_SDK_VERSION < 17
         native_window_api_disconnect(mANW.get(), NATIVE_WINDOW_API_CPU);
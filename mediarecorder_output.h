@@ -109,15 +109,25 @@ private:
 };
 
 
+// max number of buffers a BufferQueue may hand out (NUM_BUFFER_SLOTS)
+#define GRAPHIC_BUFFER_CACHE_SIZE 32
+
 class CPUMediaRecorderOutput : public AbstractMediaRecorderOutput {
 public:
-    CPUMediaRecorderOutput() {}
+    CPUMediaRecorderOutput() : cachedBufferCount(0) {}
     virtual ~CPUMediaRecorderOutput() {}
     virtual void setupOutput();
     virtual void renderFrame();
     virtual void closeOutput(bool fromMainThread);
 
 private:
+    // GraphicBuffer wrappers of dequeued buffers, created once per buffer queue slot
+    ANativeWindowBuffer* cachedAnbs[GRAPHIC_BUFFER_CACHE_SIZE];
+    sp<GraphicBuffer> cachedBuffers[GRAPHIC_BUFFER_CACHE_SIZE];
+    int cachedBufferCount;
+
+    sp<GraphicBuffer> getGraphicBuffer(ANativeWindowBuffer* anb);
+    void clearGraphicBufferCache();
     void fillBuffer(sp<GraphicBuffer> buf);
     void copyRotateYUVBuf(uint8_t* yuvPixels, uint8_t* screen, int stride);
     void copyRotateBuf(uint32_t* bufPixels, uint32_t* screen, int stride);
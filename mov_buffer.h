@@ -0,0 +1,97 @@
+#ifndef SCREENREC_MOV_BUFFER_H
+#define SCREENREC_MOV_BUFFER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Growable big endian buffer for writing MP4 atoms.
+struct MovBuffer {
+    uint8_t *data;
+    int size;
+    int capacity;
+    bool failed;
+};
+
+static inline void putBytes(MovBuffer *b, const void *bytes, int count) {
+    if (b->size + count > b->capacity) {
+        int capacity = b->capacity * 2 + count;
+        uint8_t *data = (uint8_t*) realloc(b->data, capacity);
+        if (data == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->data = data;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, bytes, count);
+    b->size += count;
+}
+
+static inline void put8(MovBuffer *b, uint32_t v) {
+    uint8_t bytes[1] = { (uint8_t) v };
+    putBytes(b, bytes, 1);
+}
+
+static inline void put16(MovBuffer *b, uint32_t v) {
+    uint8_t bytes[2] = { (uint8_t) (v >> 8), (uint8_t) v };
+    putBytes(b, bytes, 2);
+}
+
+static inline void put24(MovBuffer *b, uint32_t v) {
+    uint8_t bytes[3] = { (uint8_t) (v >> 16), (uint8_t) (v >> 8), (uint8_t) v };
+    putBytes(b, bytes, 3);
+}
+
+static inline void put32(MovBuffer *b, uint32_t v) {
+    uint8_t bytes[4] = { (uint8_t) (v >> 24), (uint8_t) (v >> 16), (uint8_t) (v >> 8), (uint8_t) v };
+    putBytes(b, bytes, 4);
+}
+
+static inline void put64(MovBuffer *b, uint64_t v) {
+    put32(b, (uint32_t) (v >> 32));
+    put32(b, (uint32_t) v);
+}
+
+static inline void putZeros(MovBuffer *b, int count) {
+    while (count-- > 0) {
+        put8(b, 0);
+    }
+}
+
+static inline void writeBE32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// writes the atom header with a size placeholder, returns its position for endAtom()
+static inline int beginAtom(MovBuffer *b, const char *type) {
+    int pos = b->size;
+    put32(b, 0);
+    putBytes(b, type, 4);
+    return pos;
+}
+
+static inline void endAtom(MovBuffer *b, int pos) {
+    if (b->failed) {
+        return;
+    }
+    writeBE32(b->data + pos, b->size - pos);
+}
+
+static inline void putFullAtomHeader(MovBuffer *b, int version, int flags) {
+    put8(b, version);
+    put24(b, flags);
+}
+
+static inline uint32_t readBE32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline uint64_t readBE64(const uint8_t *p) {
+    return ((uint64_t) readBE32(p) << 32) | readBE32(p + 4);
+}
+
+#endif
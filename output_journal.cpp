@@ -0,0 +1,678 @@
+#include "output_journal.h"
+#include "mov_buffer.h"
+#include "faststart.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int OutputJournal::open(const char *mediaPath) {
+    snprintf(path, sizeof(path), "%s" JOURNAL_SUFFIX, mediaPath);
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0744);
+    if (fd < 0) {
+        return errno;
+    }
+    if (!blocks.init(JOURNAL_BLOCKS)) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+int OutputJournal::writeHeader(int64_t dataOffset, int headerReserve, const JournalStream *streams, const uint8_t * const *extradata, int streamCount) {
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.streamCount = streamCount;
+    header.headerReserve = headerReserve;
+    header.dataOffset = dataOffset;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        return errno;
+    }
+    for (int i = 0; i < streamCount; i++) {
+        if (write(fd, &streams[i], sizeof(JournalStream)) != sizeof(JournalStream)) {
+            return errno;
+        }
+        int size = streams[i].extradataSize;
+        if (size > 0 && write(fd, extradata[i], size) != size) {
+            return errno;
+        }
+        // keep the following records aligned
+        static const uint8_t padding[JOURNAL_ALIGN] = {0};
+        int paddingSize = JOURNAL_ALIGNED(size) - size;
+        if (paddingSize > 0 && write(fd, padding, paddingSize) != paddingSize) {
+            return errno;
+        }
+    }
+    // synced with the first block of samples
+    if (pthread_create(&thread, NULL, OutputJournal::threadStart, this) != 0) {
+        return errno;
+    }
+    threadStarted = true;
+    return 0;
+}
+
+void OutputJournal::addSample(int stream, int64_t offset, int size, int64_t dts, int ctsOffset, int duration, bool key) {
+    if (fd < 0 || failed || overflowed) {
+        return;
+    }
+    if (current == NULL) {
+        current = blocks.beginWrite(false);
+        if (current == NULL) {
+            // the file stays recoverable up to the samples journaled so far
+            ALOGW("Journal thread can't keep up, journaling stopped after %lld samples", samples);
+            overflowed = true;
+            return;
+        }
+        current->count = 0;
+        blockStartUs = getTimeUs();
+    }
+    JournalSample *sample = &current->samples[current->count++];
+    sample->offset = offset;
+    sample->dts = dts;
+    sample->size = size;
+    sample->ctsOffset = ctsOffset;
+    sample->duration = duration;
+    sample->stream = stream;
+    sample->key = key ? 1 : 0;
+    sample->reserved = 0;
+    samples++;
+
+    if (current->count == JOURNAL_BUFFER_SAMPLES || getTimeUs() - blockStartUs >= JOURNAL_SYNC_INTERVAL_US) {
+        submitBlock();
+    }
+}
+
+void OutputJournal::submitBlock() {
+    blocks.commitWrite();
+    current = NULL;
+}
+
+void* OutputJournal::threadStart(void* args) {
+    applyThreadRole(THREAD_MUXER);
+    static_cast<OutputJournal*>(args)->run();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void OutputJournal::run() {
+    JournalBlock *block;
+    while ((block = blocks.beginRead(true)) != NULL) {
+        if (!failed && !discard) {
+            writeBlock(block);
+        }
+        blocks.commitRead();
+    }
+}
+
+// Appends a block of samples and syncs it to storage, media data referenced by samples which didn't
+// reach the output file before a crash is detected during recovery by comparing with the file size.
+void OutputJournal::writeBlock(JournalBlock *block) {
+    int64_t startUs = getTimeUs();
+    int size = block->count * sizeof(JournalSample);
+    if (write(fd, block->samples, size) != size || fdatasync(fd) != 0) {
+        ALOGE("Error writing journal %s", strerror(errno));
+        failed = true;
+        return;
+    }
+    int64_t syncUs = getTimeUs() - startUs;
+    if (syncUs > maxSyncUs) {
+        maxSyncUs = syncUs;
+    }
+    syncs++;
+}
+
+void OutputJournal::close(bool remove) {
+    if (fd >= 0) {
+        if (current != NULL && !remove) {
+            submitBlock();
+        }
+        // blocks still queued aren't needed if the journal is removed
+        discard = remove;
+        blocks.close();
+        if (threadStarted) {
+            pthread_join(thread, NULL);
+            threadStarted = false;
+        }
+        ::close(fd);
+        fd = -1;
+    }
+    // a journal with a failed write isn't trusted for recovery
+    if ((remove || failed) && path[0] != '\0') {
+        unlink(path);
+    }
+}
+
+void OutputJournal::printStats() {
+    ALOGI("journal samples:%lld syncs:%d max:%lldms", samples, syncs, maxSyncUs / 1000);
+    printf("journal %lld %d %lldms\n", samples, syncs, maxSyncUs / 1000);
+    fflush(stdout);
+}
+
+static void putMatrix(MovBuffer *b) {
+    put32(b, 0x00010000);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0x00010000);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0x40000000);
+}
+
+// descriptor length is always written on 4 bytes like the FFmpeg mov muxer does
+static void putDescriptor(MovBuffer *b, int tag, int size) {
+    put8(b, tag);
+    put8(b, 0x80 | ((size >> 21) & 0x7f));
+    put8(b, 0x80 | ((size >> 14) & 0x7f));
+    put8(b, 0x80 | ((size >> 7) & 0x7f));
+    put8(b, size & 0x7f);
+}
+
+// samples of one stream, in decoding order
+struct RecoveredTrack {
+    const JournalStream *stream;
+    const uint8_t *extradata;
+    JournalSample **samples;
+    int sampleCount;
+    int64_t duration; // in stream time scale
+    int64_t movieDuration; // in movie time scale
+};
+
+#define RECOVER_MOVIE_TIME_SCALE 1000
+
+static int64_t getSampleDuration(RecoveredTrack *track, int i) {
+    if (i + 1 < track->sampleCount) {
+        return track->samples[i + 1]->dts - track->samples[i]->dts;
+    }
+    if (track->samples[i]->duration > 0) {
+        return track->samples[i]->duration;
+    }
+    return i > 0 ? track->samples[i]->dts - track->samples[i - 1]->dts : 0;
+}
+
+static void putEsds(MovBuffer *b, RecoveredTrack *track, int trackId) {
+    const JournalStream *stream = track->stream;
+    int extraSize = stream->extradataSize;
+    int decoderSpecificSize = extraSize > 0 ? 5 + extraSize : 0;
+    int decoderConfigSize = 13 + decoderSpecificSize;
+    int esSize = 3 + 5 + decoderConfigSize + 5 + 1;
+
+    int esds = beginAtom(b, "esds");
+    putFullAtomHeader(b, 0, 0);
+    putDescriptor(b, 0x03, esSize);
+    put16(b, trackId);
+    put8(b, 0);
+
+    putDescriptor(b, 0x04, decoderConfigSize);
+    put8(b, stream->objectType);
+    put8(b, stream->type == JOURNAL_STREAM_VIDEO ? 0x11 : 0x15);
+    int maxSize = 0;
+    for (int i = 0; i < track->sampleCount; i++) {
+        if (track->samples[i]->size > maxSize) {
+            maxSize = track->samples[i]->size;
+        }
+    }
+    put24(b, maxSize);
+    put32(b, stream->bitRate);
+    put32(b, stream->bitRate);
+    if (extraSize > 0) {
+        putDescriptor(b, 0x05, extraSize);
+        putBytes(b, track->extradata, extraSize);
+    }
+
+    putDescriptor(b, 0x06, 1);
+    put8(b, 0x02);
+    endAtom(b, esds);
+}
+
+static void putSampleDescription(MovBuffer *b, RecoveredTrack *track, int trackId) {
+    const JournalStream *stream = track->stream;
+    int stsd = beginAtom(b, "stsd");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 1);
+    if (stream->type == JOURNAL_STREAM_VIDEO) {
+        int mp4v = beginAtom(b, "mp4v");
+        putZeros(b, 6);
+        put16(b, 1); // data reference index
+        putZeros(b, 16);
+        put16(b, stream->width);
+        put16(b, stream->height);
+        put32(b, 0x00480000); // 72 dpi
+        put32(b, 0x00480000);
+        put32(b, 0);
+        put16(b, 1); // frames per sample
+        putZeros(b, 32); // compressor name
+        put16(b, 0x18);
+        put16(b, 0xffff);
+        putEsds(b, track, trackId);
+        endAtom(b, mp4v);
+    } else {
+        int mp4a = beginAtom(b, "mp4a");
+        putZeros(b, 6);
+        put16(b, 1); // data reference index
+        putZeros(b, 8);
+        put16(b, stream->channels);
+        put16(b, 16);
+        put16(b, 0);
+        put16(b, 0);
+        put32(b, stream->sampleRate << 16);
+        putEsds(b, track, trackId);
+        endAtom(b, mp4a);
+    }
+    endAtom(b, stsd);
+}
+
+static void putSampleTable(MovBuffer *b, RecoveredTrack *track, int trackId) {
+    int stbl = beginAtom(b, "stbl");
+    putSampleDescription(b, track, trackId);
+
+    // decoding time deltas, run length encoded
+    int stts = beginAtom(b, "stts");
+    putFullAtomHeader(b, 0, 0);
+    int entriesPos = b->size;
+    put32(b, 0);
+    int entries = 0;
+    for (int i = 0; i < track->sampleCount;) {
+        int64_t delta = getSampleDuration(track, i);
+        int count = 1;
+        while (i + count < track->sampleCount && getSampleDuration(track, i + count) == delta) {
+            count++;
+        }
+        put32(b, count);
+        put32(b, delta);
+        entries++;
+        i += count;
+    }
+    if (!b->failed) {
+        writeBE32(b->data + entriesPos, entries);
+    }
+    endAtom(b, stts);
+
+    bool reordered = false;
+    int keyframes = 0;
+    for (int i = 0; i < track->sampleCount; i++) {
+        reordered |= track->samples[i]->ctsOffset != 0;
+        keyframes += track->samples[i]->key;
+    }
+
+    if (reordered) {
+        int ctts = beginAtom(b, "ctts");
+        putFullAtomHeader(b, 0, 0);
+        entriesPos = b->size;
+        put32(b, 0);
+        entries = 0;
+        for (int i = 0; i < track->sampleCount;) {
+            int offset = track->samples[i]->ctsOffset;
+            int count = 1;
+            while (i + count < track->sampleCount && track->samples[i + count]->ctsOffset == offset) {
+                count++;
+            }
+            put32(b, count);
+            put32(b, offset);
+            entries++;
+            i += count;
+        }
+        if (!b->failed) {
+            writeBE32(b->data + entriesPos, entries);
+        }
+        endAtom(b, ctts);
+    }
+
+    // all samples are sync samples if there is no stss atom
+    if (track->stream->type == JOURNAL_STREAM_VIDEO && keyframes < track->sampleCount) {
+        int stss = beginAtom(b, "stss");
+        putFullAtomHeader(b, 0, 0);
+        put32(b, keyframes);
+        for (int i = 0; i < track->sampleCount; i++) {
+            if (track->samples[i]->key) {
+                put32(b, i + 1);
+            }
+        }
+        endAtom(b, stss);
+    }
+
+    // one sample per chunk keeps the table simple, chunk offsets are the sample offsets
+    int stsc = beginAtom(b, "stsc");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 1);
+    put32(b, 1);
+    put32(b, 1);
+    put32(b, 1);
+    endAtom(b, stsc);
+
+    int stsz = beginAtom(b, "stsz");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 0);
+    put32(b, track->sampleCount);
+    for (int i = 0; i < track->sampleCount; i++) {
+        put32(b, track->samples[i]->size);
+    }
+    endAtom(b, stsz);
+
+    int co64 = beginAtom(b, "co64");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, track->sampleCount);
+    for (int i = 0; i < track->sampleCount; i++) {
+        put64(b, track->samples[i]->offset);
+    }
+    endAtom(b, co64);
+
+    endAtom(b, stbl);
+}
+
+static void putTrack(MovBuffer *b, RecoveredTrack *track, int trackId) {
+    bool video = track->stream->type == JOURNAL_STREAM_VIDEO;
+    int trak = beginAtom(b, "trak");
+
+    int tkhd = beginAtom(b, "tkhd");
+    putFullAtomHeader(b, 0, 0x03); // enabled, in movie
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, trackId);
+    put32(b, 0);
+    put32(b, track->movieDuration);
+    putZeros(b, 8);
+    put16(b, 0); // layer
+    put16(b, 0); // alternate group
+    put16(b, video ? 0 : 0x0100); // volume
+    put16(b, 0);
+    putMatrix(b);
+    put32(b, video ? track->stream->width << 16 : 0);
+    put32(b, video ? track->stream->height << 16 : 0);
+    endAtom(b, tkhd);
+
+    int mdia = beginAtom(b, "mdia");
+    int mdhd = beginAtom(b, "mdhd");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, track->stream->timeScale);
+    put32(b, track->duration);
+    put16(b, 0x55c4); // "und"
+    put16(b, 0);
+    endAtom(b, mdhd);
+
+    int hdlr = beginAtom(b, "hdlr");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 0);
+    putBytes(b, video ? "vide" : "soun", 4);
+    putZeros(b, 12);
+    const char *name = video ? "VideoHandler" : "SoundHandler";
+    putBytes(b, name, strlen(name) + 1);
+    endAtom(b, hdlr);
+
+    int minf = beginAtom(b, "minf");
+    if (video) {
+        int vmhd = beginAtom(b, "vmhd");
+        putFullAtomHeader(b, 0, 1);
+        putZeros(b, 8);
+        endAtom(b, vmhd);
+    } else {
+        int smhd = beginAtom(b, "smhd");
+        putFullAtomHeader(b, 0, 0);
+        putZeros(b, 4);
+        endAtom(b, smhd);
+    }
+    int dinf = beginAtom(b, "dinf");
+    int dref = beginAtom(b, "dref");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 1);
+    int url = beginAtom(b, "url ");
+    putFullAtomHeader(b, 0, 1); // data in the same file
+    endAtom(b, url);
+    endAtom(b, dref);
+    endAtom(b, dinf);
+    putSampleTable(b, track, trackId);
+    endAtom(b, minf);
+    endAtom(b, mdia);
+
+    endAtom(b, trak);
+}
+
+static void putMovie(MovBuffer *b, RecoveredTrack *tracks, int trackCount) {
+    int64_t movieDuration = 0;
+    for (int i = 0; i < trackCount; i++) {
+        if (tracks[i].movieDuration > movieDuration) {
+            movieDuration = tracks[i].movieDuration;
+        }
+    }
+
+    int moov = beginAtom(b, "moov");
+    int mvhd = beginAtom(b, "mvhd");
+    putFullAtomHeader(b, 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, RECOVER_MOVIE_TIME_SCALE);
+    put32(b, movieDuration);
+    put32(b, 0x00010000); // rate
+    put16(b, 0x0100); // volume
+    putZeros(b, 10);
+    putMatrix(b);
+    putZeros(b, 24);
+    put32(b, trackCount + 1); // next track id
+    endAtom(b, mvhd);
+
+    int trackId = 1;
+    for (int i = 0; i < trackCount; i++) {
+        if (tracks[i].sampleCount > 0) {
+            putTrack(b, &tracks[i], trackId++);
+        }
+    }
+    endAtom(b, moov);
+}
+
+// walks the top level atoms, a completed file has a moov atom
+static bool hasMovieAtom(int fd, int64_t fileSize) {
+    int64_t pos = 0;
+    uint8_t header[16];
+    while (pos + 8 <= fileSize) {
+        if (pread64(fd, header, 16, pos) < 8) {
+            return false;
+        }
+        if (memcmp(header + 4, "moov", 4) == 0) {
+            return true;
+        }
+        uint64_t size = readBE32(header);
+        if (size == 1) {
+            size = ((uint64_t) readBE32(header + 8) << 32) | readBE32(header + 12);
+        } else if (size == 0) {
+            return false; // extends to the end of the file, an unfinished mdat
+        }
+        if (size < 8) {
+            return false;
+        }
+        pos += size;
+    }
+    return false;
+}
+
+// Rebuilds the moov atom of an output file left without one using its journal.
+// Returns 0 or an error code for the shell command result.
+int recoverRecording(const char *mediaPath) {
+    int64_t startUs = getTimeUs();
+    char journalPath[PATH_MAX];
+    snprintf(journalPath, sizeof(journalPath), "%s" JOURNAL_SUFFIX, mediaPath);
+
+    int journalFd = open(journalPath, O_RDONLY);
+    if (journalFd < 0) {
+        ALOGE("Can't open journal %s %s", journalPath, strerror(errno));
+        return 180;
+    }
+    struct stat journalStat;
+    uint8_t *journal = NULL;
+    int journalSize = 0;
+    if (fstat(journalFd, &journalStat) == 0 && journalStat.st_size >= (off_t) sizeof(JournalHeader)) {
+        journalSize = journalStat.st_size;
+        journal = (uint8_t*) malloc(journalSize);
+        if (journal == NULL || read(journalFd, journal, journalSize) != journalSize) {
+            journalSize = 0;
+        }
+    }
+    close(journalFd);
+
+    JournalHeader *header = (JournalHeader*) journal;
+    if (journalSize == 0 || memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0
+            || header->streamCount < 1 || header->streamCount > 2) {
+        ALOGE("Invalid journal %s", journalPath);
+        free(journal);
+        return 181;
+    }
+
+    RecoveredTrack tracks[2];
+    memset(tracks, 0, sizeof(tracks));
+    int trackCount = header->streamCount;
+    int pos = sizeof(JournalHeader);
+    for (int i = 0; i < trackCount; i++) {
+        if (pos + (int) sizeof(JournalStream) > journalSize) {
+            free(journal);
+            return 181;
+        }
+        tracks[i].stream = (JournalStream*) (journal + pos);
+        pos += sizeof(JournalStream);
+        tracks[i].extradata = journal + pos;
+        pos += JOURNAL_ALIGNED(tracks[i].stream->extradataSize);
+        if (pos > journalSize || tracks[i].stream->timeScale == 0) {
+            free(journal);
+            return 181;
+        }
+    }
+    // a record cut off by the crash is ignored
+    int sampleCount = (journalSize - pos) / sizeof(JournalSample);
+    JournalSample *samples = (JournalSample*) (journal + pos);
+    JournalSample **sampleIndex = (JournalSample**) malloc(sampleCount * sizeof(JournalSample*) + 1);
+    if (sampleIndex == NULL) {
+        free(journal);
+        return 181;
+    }
+
+    int fd = open(mediaPath, O_RDWR);
+    struct stat mediaStat;
+    if (fd < 0 || fstat(fd, &mediaStat) != 0) {
+        ALOGE("Can't open %s %s", mediaPath, strerror(errno));
+        free(journal);
+        free(sampleIndex);
+        return 182;
+    }
+    int64_t fileSize = mediaStat.st_size;
+
+    int ret = 0;
+    if (hasMovieAtom(fd, fileSize)) {
+        ALOGI("%s is complete, removing the journal", mediaPath);
+        unlink(journalPath);
+        close(fd);
+        free(journal);
+        free(sampleIndex);
+        return 0;
+    }
+
+    // samples whose data didn't reach the file before the crash are dropped
+    int64_t dataEnd = header->dataOffset;
+    int validSamples = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        JournalSample *s = &samples[i];
+        if (s->stream >= trackCount || s->size <= 0 || s->offset < header->dataOffset
+                || s->offset + s->size > fileSize) {
+            s->size = 0;
+            continue;
+        }
+        tracks[s->stream].sampleCount++;
+        validSamples++;
+        if (s->offset + s->size > dataEnd) {
+            dataEnd = s->offset + s->size;
+        }
+    }
+
+    // group the samples by stream, the journal is in file order which is decoding order per stream
+    int next = 0;
+    for (int t = 0; t < trackCount; t++) {
+        tracks[t].samples = sampleIndex + next;
+        next += tracks[t].sampleCount;
+        tracks[t].sampleCount = 0;
+    }
+    for (int i = 0; i < sampleCount; i++) {
+        if (samples[i].size > 0) {
+            RecoveredTrack *track = &tracks[samples[i].stream];
+            track->samples[track->sampleCount++] = &samples[i];
+        }
+    }
+    for (int t = 0; t < trackCount; t++) {
+        RecoveredTrack *track = &tracks[t];
+        for (int i = 0; i < track->sampleCount; i++) {
+            track->duration += getSampleDuration(track, i);
+        }
+        track->movieDuration = track->duration * RECOVER_MOVIE_TIME_SCALE / track->stream->timeScale;
+    }
+
+    if (validSamples == 0) {
+        ALOGE("No samples to recover in %s", mediaPath);
+        ret = 184;
+    }
+
+    // fix the size of the mdat atom, the FFmpeg mov muxer writes it after a "free" or "wide"
+    // placeholder atom that can be replaced with a 64 bit size
+    uint8_t mdatHeader[16];
+    int64_t mdatPos = header->dataOffset - 8;
+    if (ret == 0 && (mdatPos < 8 || pread64(fd, mdatHeader, 16, mdatPos - 8) != 16
+            || memcmp(mdatHeader + 12, "mdat", 4) != 0)) {
+        ALOGE("No mdat atom at %lld in %s", mdatPos, mediaPath);
+        ret = 181;
+    }
+    if (ret == 0) {
+        uint64_t mdatSize = dataEnd - mdatPos;
+        uint8_t *p = mdatHeader + 8;
+        int64_t patchPos = mdatPos;
+        int patchSize = 4;
+        if (mdatSize > UINT32_MAX) {
+            if (memcmp(mdatHeader + 4, "wide", 4) != 0 && memcmp(mdatHeader + 4, "free", 4) != 0) {
+                ret = 181;
+            }
+            // 64 bit size in place of the placeholder atom
+            mdatSize += 8;
+            p = mdatHeader;
+            patchPos = mdatPos - 8;
+            patchSize = 16;
+            writeBE32(p, 1);
+            memcpy(p + 4, "mdat", 4);
+            writeBE32(p + 8, mdatSize >> 32);
+        }
+        writeBE32(p + patchSize - 4, mdatSize);
+        if (ret == 0 && pwrite64(fd, p, patchSize, patchPos) != patchSize) {
+            ret = 183;
+        }
+    }
+
+    MovBuffer movie;
+    memset(&movie, 0, sizeof(movie));
+    if (ret == 0) {
+        putMovie(&movie, tracks, trackCount);
+        // anything after the last complete sample is cut off, the moov atom goes to the reserved
+        // space at the beginning if there is one and it's large enough, otherwise to the end
+        int placed = 0;
+        if (header->headerReserve > 0 && !movie.failed) {
+            placed = writeMovieHeader(fd, header->headerReserve, movie.data, movie.size);
+        }
+        if (movie.failed || placed < 0) {
+            ret = 183;
+        } else if (ftruncate64(fd, dataEnd) != 0
+                || (placed == 0 && pwrite64(fd, movie.data, movie.size, dataEnd) != movie.size)
+                || fsync(fd) != 0) {
+            ALOGE("Error writing %s %s", mediaPath, strerror(errno));
+            ret = 183;
+        }
+    }
+    close(fd);
+
+    if (ret == 0) {
+        unlink(journalPath);
+        ALOGI("Recovered %s: %d of %d samples, %lld bytes, moov %d bytes in %lldms", mediaPath, validSamples,
+                sampleCount, dataEnd, movie.size, (getTimeUs() - startUs) / 1000);
+    }
+    free(movie.data);
+    free(journal);
+    free(sampleIndex);
+    return ret;
+}
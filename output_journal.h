@@ -0,0 +1,135 @@
+#ifndef SCREENREC_OUTPUT_JOURNAL_H
+#define SCREENREC_OUTPUT_JOURNAL_H
+
+#include "screenrec.h"
+#include "spsc_queue.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+// journal file name is the output file name with this suffix
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC "SCRJRNL1"
+
+// samples buffered in memory between journal writes
+#define JOURNAL_BUFFER_SAMPLES 256
+// the journal is written and synced to storage at least this often
+#define JOURNAL_SYNC_INTERVAL_US 1000000
+// blocks of samples waiting for the journal thread, journaling stops if they are all full
+#define JOURNAL_BLOCKS 8
+
+// extradata is padded so that stream headers and samples stay 8 byte aligned
+#define JOURNAL_ALIGN 8
+#define JOURNAL_ALIGNED(size) (((size) + JOURNAL_ALIGN - 1) & ~(JOURNAL_ALIGN - 1))
+
+#define JOURNAL_STREAM_VIDEO 0
+#define JOURNAL_STREAM_AUDIO 1
+
+// MPEG-4 object type indications used in the esds atom
+#define JOURNAL_OBJECT_MPEG4_VISUAL 0x20
+#define JOURNAL_OBJECT_AAC 0x40
+
+// Journal layout: JournalHeader, streamCount times JournalStream followed by its padded extradata,
+// then JournalSample records until the end of the file. All values are in host byte order,
+// the journal is only read on the device that wrote it.
+struct JournalHeader {
+    char magic[8];
+    uint32_t streamCount;
+    uint32_t headerReserve; // space before the ftyp atom, see faststart.h
+    int64_t dataOffset; // first byte of the mdat payload in the output file
+};
+
+struct JournalStream {
+    uint32_t type;
+    uint32_t objectType;
+    uint32_t timeScale;
+    uint32_t width;
+    uint32_t height;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint32_t bitRate;
+    uint32_t extradataSize;
+    uint32_t reserved;
+};
+
+struct JournalSample {
+    int64_t offset;
+    int64_t dts; // in stream time scale
+    int32_t size;
+    int32_t ctsOffset; // pts - dts
+    int32_t duration;
+    uint8_t stream;
+    uint8_t key;
+    uint16_t reserved;
+};
+
+struct JournalBlock {
+    JournalSample samples[JOURNAL_BUFFER_SAMPLES];
+    int count;
+};
+
+// Sidecar index of the samples written to an MP4 file by the FFmpeg output.
+// If the recording is killed before the moov atom is written recoverRecording()
+// rebuilds it from the journal without scanning the media data.
+// Samples are collected in blocks on the muxer thread and written and synced by a separate
+// thread, fdatasync() may wait for the writeback of the media file as well.
+class OutputJournal {
+public:
+    OutputJournal()
+        : fd(-1),
+          current(NULL),
+          blockStartUs(0),
+          threadStarted(false),
+          failed(false),
+          discard(false),
+          overflowed(false),
+          samples(0),
+          syncs(0),
+          maxSyncUs(0) {
+        path[0] = '\0';
+    }
+
+    ~OutputJournal() {}
+
+    // returns errno on failure
+    int open(const char *mediaPath);
+    // starts the journal thread
+    int writeHeader(int64_t dataOffset, int headerReserve, const JournalStream *streams, const uint8_t * const *extradata, int streamCount);
+    // muxer thread, never waits for the journal thread
+    void addSample(int stream, int64_t offset, int size, int64_t dts, int ctsOffset, int duration, bool key);
+    // waits for the journal thread, the journal is removed if the output file was completed
+    void close(bool remove);
+
+    bool isOpen() {
+        return fd >= 0;
+    }
+
+    void printStats();
+
+private:
+    int fd;
+    char path[PATH_MAX];
+
+    SpscQueue<JournalBlock> blocks;
+    JournalBlock *current; // filled by the muxer thread
+    int64_t blockStartUs;
+    pthread_t thread;
+    bool threadStarted;
+    volatile bool failed;
+    volatile bool discard;
+    bool overflowed;
+
+    int64_t samples;
+    // journal thread statistics
+    int syncs;
+    int64_t maxSyncUs;
+
+    static void* threadStart(void* args);
+    void run();
+    void writeBlock(JournalBlock *block);
+    void submitBlock();
+};
+
+int recoverRecording(const char *mediaPath);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef SCREENREC_PACKET_ARENA_H
+#define SCREENREC_PACKET_ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Single-producer/single-consumer ring allocator for encoded packet data.
+// The producer carves contiguous blocks at the head, the consumer releases them
+// in the same order so freeing is just moving the tail forward.
+// A block which doesn't fit before the end of the buffer starts at the beginning,
+// the skipped space is released together with that block.
+class PacketArena {
+public:
+    PacketArena()
+        : buffer(NULL),
+          capacity(0),
+          mask(0),
+          head(0),
+          tail(0),
+          misses(0) {}
+
+    ~PacketArena() {
+        free(buffer);
+    }
+
+    // capacity is rounded up to the next power of two
+    bool init(int minCapacity) {
+        capacity = 4096;
+        while (capacity < (uint32_t) minCapacity) {
+            capacity *= 2;
+        }
+        mask = capacity - 1;
+        buffer = (uint8_t*) malloc(capacity);
+        return buffer != NULL;
+    }
+
+    // producer: returns NULL if there is not enough free space
+    uint8_t* alloc(int size) {
+        uint32_t total = (HEADER_SIZE + size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+        uint32_t h = head;
+        uint32_t start = h;
+        if ((start & mask) + total > capacity) {
+            start += capacity - (start & mask);
+        }
+        if (total > capacity || start + total - loadAcquire(&tail) > capacity) {
+            misses++;
+            return NULL;
+        }
+        uint8_t *block = buffer + (start & mask);
+        *(uint32_t*) block = start + total;
+        storeRelease(&head, start + total);
+        return block + HEADER_SIZE;
+    }
+
+    // consumer: release the oldest block
+    void release(uint8_t *data) {
+        storeRelease(&tail, *(uint32_t*) (data - HEADER_SIZE));
+    }
+
+    uint32_t getMisses() {
+        return misses;
+    }
+
+private:
+    // block header holds the free running position of the block end
+    static const uint32_t HEADER_SIZE = 16;
+    static const uint32_t BLOCK_ALIGN = 16;
+
+    uint8_t *buffer;
+    uint32_t capacity;
+    uint32_t mask;
+
+    volatile uint32_t head; // written by producer only
+    volatile uint32_t tail; // written by consumer only
+    volatile uint32_t misses;
+
+    static inline uint32_t loadAcquire(volatile uint32_t *value) {
+        uint32_t v = *value;
+        __sync_synchronize();
+        return v;
+    }
+
+    static inline void storeRelease(volatile uint32_t *value, uint32_t v) {
+        __sync_synchronize();
+        *value = v;
+    }
+};
+
+#endif
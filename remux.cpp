@@ -0,0 +1,416 @@
+#include "remux.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct RemuxInput {
+    AVFormatContext *ic;
+    int fd;
+};
+
+struct RemuxOutput {
+    AVFormatContext *oc;
+    FileWriter writer;
+    int64_t lastDts[REMUX_MAX_STREAMS];
+    int64_t packets;
+    int64_t bytes;
+    int dropped;
+    bool created; // the output file was created and is removed on failure
+};
+
+static void registerRemuxComponents() {
+    extern AVInputFormat ff_mov_demuxer;
+    av_register_input_format(&ff_mov_demuxer);
+
+    extern AVOutputFormat ff_mp4_muxer;
+    av_register_output_format(&ff_mp4_muxer);
+}
+
+static int readInput(void *opaque, uint8_t *buf, int size) {
+    ssize_t ret = read((int) (intptr_t) opaque, buf, size);
+    return ret < 0 ? AVERROR(errno) : ret;
+}
+
+static int64_t seekInput(void *opaque, int64_t offset, int whence) {
+    int fd = (int) (intptr_t) opaque;
+    if (whence == AVSEEK_SIZE) {
+        struct stat stats;
+        return fstat(fd, &stats) == 0 ? stats.st_size : AVERROR(errno);
+    }
+    int64_t ret = lseek64(fd, offset, whence & ~AVSEEK_FORCE);
+    return ret < 0 ? AVERROR(errno) : ret;
+}
+
+static int writeOutput(void *opaque, uint8_t *buf, int size) {
+    int ret = static_cast<FileWriter*>(opaque)->write(buf, size);
+    return ret == 0 ? size : AVERROR(ret);
+}
+
+static int64_t seekOutput(void *opaque, int64_t offset, int whence) {
+    FileWriter *writer = static_cast<FileWriter*>(opaque);
+    if (whence == AVSEEK_SIZE) {
+        return writer->getSize();
+    }
+    int64_t ret = writer->seek(offset, whence & ~AVSEEK_FORCE);
+    return ret < 0 ? AVERROR(EINVAL) : ret;
+}
+
+static void closeInput(RemuxInput *in) {
+    if (in->ic != NULL) {
+        AVIOContext *pb = in->ic->pb;
+        avformat_close_input(&in->ic);
+        if (pb != NULL) {
+            av_free(pb->buffer);
+            av_free(pb);
+        }
+    }
+    if (in->fd >= 0) {
+        close(in->fd);
+        in->fd = -1;
+    }
+}
+
+// Opens the input with large sequential reads instead of the small default AVIO buffer.
+static int openInput(const char *path, RemuxInput *in) {
+    in->ic = NULL;
+    in->fd = open(path, O_RDONLY);
+    if (in->fd < 0) {
+        ALOGE("Can't open %s %s", path, strerror(errno));
+        return 185;
+    }
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    AVFormatContext *ic = avformat_alloc_context();
+    uint8_t *buffer = (uint8_t*) av_malloc(REMUX_READ_BUFFER_SIZE);
+    if (ic == NULL || buffer == NULL) {
+        av_free(buffer);
+        avformat_free_context(ic);
+        closeInput(in);
+        return 185;
+    }
+    ic->pb = avio_alloc_context(buffer, REMUX_READ_BUFFER_SIZE, 0, (void*) (intptr_t) in->fd, readInput, NULL, seekInput);
+    AVIOContext *pb = ic->pb;
+    if (pb == NULL || avformat_open_input(&ic, path, NULL, NULL) < 0) {
+        ALOGE("Can't read %s", path);
+        // the context is freed by avformat_open_input() on failure, the custom IO context isn't
+        if (pb != NULL) {
+            av_free(pb->buffer);
+            av_free(pb);
+        } else {
+            av_free(buffer);
+            avformat_free_context(ic);
+        }
+        closeInput(in);
+        return 185;
+    }
+    in->ic = ic;
+    if (avformat_find_stream_info(ic, NULL) < 0 || ic->nb_streams > REMUX_MAX_STREAMS) {
+        ALOGE("Can't find stream info of %s", path);
+        closeInput(in);
+        return 185;
+    }
+    return 0;
+}
+
+static int findVideoStream(AVFormatContext *ic) {
+    for (unsigned int i = 0; i < ic->nb_streams; i++) {
+        if (ic->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Creates the output with copies of the input streams and writes its header.
+static int openOutput(const char *path, AVFormatContext *ic, RemuxOutput *out) {
+    out->packets = 0;
+    out->bytes = 0;
+    out->dropped = 0;
+    out->created = false;
+    for (int i = 0; i < REMUX_MAX_STREAMS; i++) {
+        out->lastDts[i] = AV_NOPTS_VALUE;
+    }
+
+    avformat_alloc_output_context2(&out->oc, NULL, NULL, path);
+    if (out->oc == NULL) {
+        ALOGE("Can't create output context for %s", path);
+        return 186;
+    }
+    for (unsigned int i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(out->oc, NULL);
+        if (st == NULL || avcodec_copy_context(st->codec, ic->streams[i]->codec) < 0) {
+            return 186;
+        }
+        // let the muxer choose the tag of the output format
+        st->codec->codec_tag = 0;
+        st->time_base = ic->streams[i]->time_base;
+        av_dict_copy(&st->metadata, ic->streams[i]->metadata, 0);
+        if (out->oc->oformat->flags & AVFMT_GLOBALHEADER) {
+            st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+        }
+    }
+
+    out->created = true;
+    int ret = out->writer.open(path, REMUX_WRITE_CHUNK_SIZE, preallocateSize, FILE_WRITER_DROP_CACHE);
+    if (ret != 0) {
+        ALOGE("Can't open %s %s", path, strerror(ret));
+        return 186;
+    }
+    uint8_t *ioBuffer = (uint8_t*) av_malloc(REMUX_WRITE_BUFFER_SIZE);
+    out->oc->pb = avio_alloc_context(ioBuffer, REMUX_WRITE_BUFFER_SIZE, 1, &out->writer, NULL, writeOutput, seekOutput);
+    if (ioBuffer == NULL || out->oc->pb == NULL || avformat_write_header(out->oc, NULL) < 0) {
+        ALOGE("Can't write header of %s", path);
+        return 186;
+    }
+    return 0;
+}
+
+// The packet data is passed to the muxer as read, only timestamps are changed.
+// offset is subtracted from the timestamps in input stream time base.
+static int writePacket(RemuxOutput *out, AVPacket *pkt, AVStream *in, int64_t offset) {
+    AVStream *st = out->oc->streams[pkt->stream_index];
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts - offset, in->time_base, st->time_base);
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q(pkt->dts - offset, in->time_base, st->time_base);
+    if (pkt->duration > 0)
+        pkt->duration = av_rescale_q(pkt->duration, in->time_base, st->time_base);
+
+    // the muxer rejects non increasing timestamps, e.g. overlapping segments
+    if (pkt->dts != AV_NOPTS_VALUE) {
+        int64_t lastDts = out->lastDts[pkt->stream_index];
+        if (lastDts != AV_NOPTS_VALUE && pkt->dts <= lastDts) {
+            out->dropped++;
+            return 0;
+        }
+        out->lastDts[pkt->stream_index] = pkt->dts;
+    }
+
+    out->packets++;
+    out->bytes += pkt->size;
+    return av_write_frame(out->oc, pkt) < 0 ? 188 : 0;
+}
+
+static int closeOutput(const char *path, RemuxOutput *out, int ret, int64_t startUs) {
+    if (out->oc == NULL) {
+        return ret;
+    }
+    if (out->oc->pb != NULL) {
+        if (ret == 0 && av_write_trailer(out->oc) < 0) {
+            ret = 188;
+        }
+        avio_flush(out->oc->pb);
+        if (out->writer.close() != 0 && ret == 0) {
+            ALOGE("Error writing %s %s", path, strerror(out->writer.getError()));
+            ret = 188;
+        }
+        av_free(out->oc->pb->buffer);
+        av_free(out->oc->pb);
+        out->oc->pb = NULL;
+    } else if (out->created) {
+        out->writer.close();
+    }
+    avformat_free_context(out->oc);
+    out->oc = NULL;
+
+    if (ret != 0) {
+        if (out->created) {
+            unlink(path);
+        }
+        return ret;
+    }
+    int64_t timeMs = (getTimeUs() - startUs) / 1000;
+    ALOGI("remuxed %s packets:%lld bytes:%lld dropped:%d %lldms", path, out->packets, out->bytes, out->dropped, timeMs);
+    printf("remux %lld %lld %d %lldms\n", out->packets, out->bytes, out->dropped, timeMs);
+    fflush(stdout);
+    out->writer.printStats();
+    return 0;
+}
+
+int trimRecording(const char *input, const char *output, int64_t startMs, int64_t endMs) {
+    if (startMs < 0 || (endMs > 0 && endMs <= startMs)) {
+        ALOGE("Invalid trim range %lldms - %lldms", startMs, endMs);
+        return 189;
+    }
+    int64_t startUs = getTimeUs();
+    registerRemuxComponents();
+
+    RemuxInput in;
+    int ret = openInput(input, &in);
+    if (ret != 0) {
+        return ret;
+    }
+    int video = findVideoStream(in.ic);
+    if (video < 0) {
+        ALOGE("No video stream in %s", input);
+        closeInput(&in);
+        return 187;
+    }
+
+    RemuxOutput out;
+    out.oc = NULL;
+    ret = openOutput(output, in.ic, &out);
+
+    AVStream *videoStream = in.ic->streams[video];
+    if (ret == 0 && startMs > 0) {
+        // positions the demuxer on the last key frame at or before the start
+        int64_t startTs = av_rescale_q(startMs * 1000, AV_TIME_BASE_Q, videoStream->time_base);
+        if (av_seek_frame(in.ic, video, startTs, AVSEEK_FLAG_BACKWARD) < 0) {
+            ALOGE("Can't seek to %lldms in %s", startMs, input);
+            ret = 188;
+        }
+    }
+
+    // everything is shifted by the dts of the first key frame, packets to be displayed
+    // before the key frame are dropped
+    int64_t cutDtsUs = AV_NOPTS_VALUE;
+    int64_t cutPtsUs = AV_NOPTS_VALUE;
+    AVPacket pkt;
+    while (ret == 0 && av_read_frame(in.ic, &pkt) >= 0) {
+        AVStream *st = in.ic->streams[pkt.stream_index];
+        int64_t pts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+        int64_t ptsUs = av_rescale_q(pts, st->time_base, AV_TIME_BASE_Q);
+        bool key = pkt.flags & AV_PKT_FLAG_KEY;
+
+        if (pkt.stream_index == video) {
+            if (cutDtsUs == AV_NOPTS_VALUE && key) {
+                cutDtsUs = av_rescale_q(pkt.dts != AV_NOPTS_VALUE ? pkt.dts : pts, st->time_base, AV_TIME_BASE_Q);
+                cutPtsUs = ptsUs;
+            } else if (cutDtsUs != AV_NOPTS_VALUE && key && endMs > 0 && ptsUs >= endMs * 1000) {
+                av_free_packet(&pkt);
+                break;
+            }
+        }
+        if (cutDtsUs == AV_NOPTS_VALUE || ptsUs < cutPtsUs) {
+            av_free_packet(&pkt);
+            continue;
+        }
+
+        ret = writePacket(&out, &pkt, st, av_rescale_q(cutDtsUs, AV_TIME_BASE_Q, st->time_base));
+        av_free_packet(&pkt);
+    }
+    if (ret == 0 && cutDtsUs == AV_NOPTS_VALUE) {
+        ALOGE("No key frame after %lldms in %s", startMs, input);
+        ret = 188;
+    }
+
+    ret = closeOutput(output, &out, ret, startUs);
+    closeInput(&in);
+    return ret;
+}
+
+static bool isSameStream(AVCodecContext *a, AVCodecContext *b) {
+    return a->codec_type == b->codec_type && a->codec_id == b->codec_id
+            && a->width == b->width && a->height == b->height
+            && a->sample_rate == b->sample_rate && a->channels == b->channels
+            && a->extradata_size == b->extradata_size
+            && (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+int concatRecordings(const char *output, const char * const *inputs, int inputCount) {
+    int64_t startUs = getTimeUs();
+    registerRemuxComponents();
+
+    RemuxInput first;
+    int ret = openInput(inputs[0], &first);
+    if (ret != 0) {
+        return ret;
+    }
+    RemuxOutput out;
+    out.oc = NULL;
+    ret = openOutput(output, first.ic, &out);
+
+    // each input starts where the longest stream of the previous one ended
+    int64_t offsetUs = 0;
+    for (int i = 0; i < inputCount && ret == 0; i++) {
+        RemuxInput in = first;
+        if (i > 0) {
+            ret = openInput(inputs[i], &in);
+            if (ret != 0) {
+                break;
+            }
+            bool compatible = in.ic->nb_streams == first.ic->nb_streams;
+            for (unsigned int s = 0; s < in.ic->nb_streams && compatible; s++) {
+                compatible = isSameStream(in.ic->streams[s]->codec, first.ic->streams[s]->codec);
+            }
+            if (!compatible) {
+                ALOGE("Streams of %s don't match %s", inputs[i], inputs[0]);
+                closeInput(&in);
+                ret = 187;
+                break;
+            }
+        }
+
+        int64_t startTimeUs = in.ic->start_time != AV_NOPTS_VALUE ? in.ic->start_time : 0;
+        int64_t endUs = offsetUs;
+        AVPacket pkt;
+        while (ret == 0 && av_read_frame(in.ic, &pkt) >= 0) {
+            AVStream *st = in.ic->streams[pkt.stream_index];
+            int64_t offset = av_rescale_q(startTimeUs - offsetUs, AV_TIME_BASE_Q, st->time_base);
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                int64_t packetEndUs = av_rescale_q(pkt.dts - offset + pkt.duration, st->time_base, AV_TIME_BASE_Q);
+                if (packetEndUs > endUs) {
+                    endUs = packetEndUs;
+                }
+            }
+            ret = writePacket(&out, &pkt, st, offset);
+            av_free_packet(&pkt);
+        }
+        offsetUs = endUs;
+        if (i > 0) {
+            closeInput(&in);
+        }
+    }
+
+    ret = closeOutput(output, &out, ret, startUs);
+    closeInput(&first);
+    return ret;
+}
+
+int runRemuxCommand(const char *command, char *args) {
+    if (strcmp(command, "trim") == 0) {
+        long long startMs, endMs;
+        int pathsPos = 0;
+        if (sscanf(args, "%lld %lld %n", &startMs, &endMs, &pathsPos) < 2 || pathsPos == 0) {
+            return 189;
+        }
+        char *outputPath = args + pathsPos;
+        char *separator = strchr(outputPath, '|');
+        if (separator == NULL) {
+            return 189;
+        }
+        *separator = '\0';
+        if (strcmp(outputPath, separator + 1) == 0) {
+            return 189;
+        }
+        return trimRecording(separator + 1, outputPath, startMs, endMs);
+    }
+
+    if (strcmp(command, "concat") == 0) {
+        const char *paths[REMUX_MAX_INPUTS + 1];
+        int count = 0;
+        char *path = args;
+        while (path != NULL && count <= REMUX_MAX_INPUTS) {
+            paths[count++] = path;
+            path = strchr(path, '|');
+            if (path != NULL) {
+                *path++ = '\0';
+            }
+        }
+        if (count < 2 || path != NULL) {
+            return 189;
+        }
+        for (int i = 1; i < count; i++) {
+            if (strcmp(paths[0], paths[i]) == 0) {
+                return 189;
+            }
+        }
+        return concatRecordings(paths[0], paths + 1, count - 1);
+    }
+    return 189;
+}
@@ -0,0 +1,40 @@
+#ifndef SCREENREC_REMUX_H
+#define SCREENREC_REMUX_H
+
+#include "screenrec.h"
+#include "file_writer.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/url.h>
+#include <libavutil/mathematics.h>
+}
+
+// input is read in blocks of this size, output uses the FileWriter chunks
+#define REMUX_READ_BUFFER_SIZE (256 * 1024)
+#define REMUX_WRITE_BUFFER_SIZE (64 * 1024)
+#define REMUX_WRITE_CHUNK_SIZE (1024 * 1024)
+
+// recordings have a video and an audio stream
+#define REMUX_MAX_STREAMS 8
+
+// max number of files joined by concat
+#define REMUX_MAX_INPUTS 64
+
+// Lossless trim and concat of MP4 recordings. Packets are copied from the demuxer to the muxer
+// without decoding, cuts are made at video key frames. Memory use doesn't depend on the file size.
+// Both return 0 or an error code for the shell command result.
+
+// Copies the part of input from the last key frame at or before startMs to the first key frame
+// at or after endMs (or the end of the file if endMs <= 0). An empty range returns 189.
+int trimRecording(const char *input, const char *output, int64_t startMs, int64_t endMs);
+
+// Joins inputs with identical stream parameters, e.g. segments of one recording.
+int concatRecordings(const char *output, const char * const *inputs, int inputCount);
+
+// Parses the arguments of the "trim" and "concat" shell commands:
+// trim <startMs> <endMs> <output>|<input>
+// concat <output>|<input>|<input>...
+int runRemuxCommand(const char *command, char *args);
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef SCREENREC_SAMPLE_RING_H
+#define SCREENREC_SAMPLE_RING_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+// Single-producer/single-consumer ring of interleaved 16bit PCM samples.
+// The producer (AudioRecord callback) never blocks or waits for the consumer.
+// When the ring is full the oldest samples are dropped by moving the read position forward,
+// a consumer racing with such overrun notices the moved read position and retries.
+// Writes and reads are done with at most two memcpy calls each. Counts passed to write()
+// and read() should be multiples of the channel count to keep channels aligned.
+// A consumer may sleep in waitAvailable(), the producer takes the mutex only to wake it up.
+class SampleRing {
+public:
+    SampleRing()
+        : buffer(NULL),
+          capacity(0),
+          mask(0),
+          writePos(0),
+          readPos(0),
+          overruns(0),
+          underruns(0),
+          droppedSamples(0),
+          closed(0),
+          readerWaiting(0),
+          wakeupThreshold(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&dataAvailable, NULL);
+    }
+
+    ~SampleRing() {
+        delete[] buffer;
+    }
+
+    // capacity is rounded up to the next power of two
+    bool init(int minCapacity) {
+        capacity = 2;
+        while (capacity < (uint32_t) minCapacity) {
+            capacity *= 2;
+        }
+        mask = capacity - 1;
+        buffer = new int16_t[capacity];
+        return buffer != NULL;
+    }
+
+    int getCapacity() {
+        return capacity;
+    }
+
+    // number of samples ready to be read
+    int available() {
+        uint32_t w = loadAcquire(&writePos);
+        uint32_t r = loadAcquire(&readPos);
+        uint32_t count = w - r;
+        return count > capacity ? capacity : count;
+    }
+
+    // producer
+    void write(const int16_t *samples, int count) {
+        if ((uint32_t) count > capacity) {
+            droppedSamples += count - capacity;
+            samples += count - capacity;
+            count = capacity;
+        }
+        uint32_t w = writePos;
+        uint32_t minReadPos = w + count - capacity;
+
+        // drop the oldest samples if there is not enough space
+        while (true) {
+            uint32_t r = loadAcquire(&readPos);
+            if ((int32_t) (minReadPos - r) <= 0) {
+                break;
+            }
+            if (__sync_bool_compare_and_swap(&readPos, r, minReadPos)) {
+                overruns++;
+                droppedSamples += minReadPos - r;
+                break;
+            }
+        }
+
+        uint32_t start = w & mask;
+        uint32_t first = capacity - start;
+        if (first > (uint32_t) count) {
+            first = count;
+        }
+        memcpy(buffer + start, samples, first * sizeof(int16_t));
+        memcpy(buffer, samples + first, (count - first) * sizeof(int16_t));
+
+        storeRelease(&writePos, w + count);
+
+        __sync_synchronize();
+        if (readerWaiting && available() >= wakeupThreshold) {
+            pthread_mutex_lock(&mutex);
+            pthread_cond_signal(&dataAvailable);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    // consumer: block until at least count samples are available,
+    // returns false if the ring was closed before that
+    bool waitAvailable(int count) {
+        while (available() < count) {
+            if (closed) {
+                return false;
+            }
+            pthread_mutex_lock(&mutex);
+            wakeupThreshold = count;
+            readerWaiting = 1;
+            __sync_synchronize();
+            while (available() < count && !closed) {
+                pthread_cond_wait(&dataAvailable, &mutex);
+            }
+            readerWaiting = 0;
+            pthread_mutex_unlock(&mutex);
+        }
+        return true;
+    }
+
+    // wake up the consumer waiting for data
+    void close() {
+        pthread_mutex_lock(&mutex);
+        closed = 1;
+        pthread_cond_broadcast(&dataAvailable);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // consumer, returns number of samples read which is less than count on underrun
+    int read(int16_t *samples, int count) {
+        while (true) {
+            uint32_t r = loadAcquire(&readPos);
+            uint32_t w = loadAcquire(&writePos);
+            uint32_t n = w - r;
+            if (n > (uint32_t) count) {
+                n = count;
+            }
+
+            uint32_t start = r & mask;
+            uint32_t first = capacity - start;
+            if (first > n) {
+                first = n;
+            }
+            memcpy(samples, buffer + start, first * sizeof(int16_t));
+            memcpy(samples + first, buffer, (n - first) * sizeof(int16_t));
+
+            // fails only if the producer dropped samples while we were copying them
+            if (__sync_bool_compare_and_swap(&readPos, r, r + n)) {
+                if (n < (uint32_t) count) {
+                    underruns++;
+                }
+                return n;
+            }
+        }
+    }
+
+    // counters are updated by one side only and may be read from any thread
+    uint32_t getOverruns() {
+        return overruns;
+    }
+
+    uint32_t getUnderruns() {
+        return underruns;
+    }
+
+    uint32_t getDroppedSamples() {
+        return droppedSamples;
+    }
+
+private:
+    int16_t *buffer;
+    uint32_t capacity;
+    uint32_t mask;
+
+    // free running positions, wrapping is handled by the power of two mask
+    volatile uint32_t writePos; // written by producer only
+    volatile uint32_t readPos;  // advanced by consumer, or by producer on overrun
+
+    volatile uint32_t overruns;
+    volatile uint32_t underruns;
+    volatile uint32_t droppedSamples;
+
+    volatile int32_t closed;
+    volatile int32_t readerWaiting;
+    volatile int32_t wakeupThreshold;
+    pthread_mutex_t mutex;
+    pthread_cond_t dataAvailable;
+
+    static inline uint32_t loadAcquire(volatile uint32_t *value) {
+        uint32_t v = *value;
+        __sync_synchronize();
+        return v;
+    }
+
+    static inline void storeRelease(volatile uint32_t *value, uint32_t v) {
+        __sync_synchronize();
+        *value = v;
+    }
+};
+
+#endif
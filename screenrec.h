@@ -48,6 +48,32 @@ extern bool useYUV_SP;
 extern int videoEncoder;
 extern bool allowVerticalFrames;
 
+// Optional parameters
+extern int idleFrameRate;
+extern int frameQueueDepth;
+extern int muxerBufferSize;
+extern int muxerHighWatermark;
+extern int keyframeInterval;
+extern int encoderThreads;
+extern char encoderPreset[16];
+extern bool adaptiveEncoding;
+extern int audioCaptureRate;
+extern int micGain;
+extern int internalGain;
+extern int writeChunkSize;
+extern int preallocateSize;
+extern bool dropWriteCache;
+extern bool directWrites;
+extern int fragmentDuration;
+extern int segmentSize;
+extern int segmentDuration;
+extern int faststartReserve;
+extern bool outputJournal;
+extern bool keyframeIndex;
+extern int storageMonitorInterval;
+extern int writeProbe;
+extern bool writeProbeCap;
+
 
 // Output
 extern int outputFd;
@@ -58,9 +84,16 @@ extern void const* inputBase;
 extern int inputWidth, inputHeight, inputStride;
 extern bool rotateView;
 
+// statistics
+extern float encodeFps;
+extern int encodeBitrate;
+extern float encodePsnr;
+
 // global state
+extern volatile bool finished;
 extern bool stopping;
 extern bool mrRunning;
+extern bool testMode;
 extern int frameCount;
 
 extern pthread_t stoppingThread;
@@ -70,11 +103,15 @@ int startRecording(char *config);
 void setupInput();
 
 void updateInput();
+uint32_t inputChecksum();
+bool inputChecksumSupported();
 void updateTexImage(); // check if it can't be removed after moving updateInput() invocation
 void stop(int error, const char* message);
 void stop(int error, bool fromMainThread, const char* message);
 void closeInput();
 int64_t getTimeMs();
+int64_t getTimeUs();
+int64_t getAllocationCount(); // -1 unless built with SCR_ALLOC_DEBUG
 void trim(char* str);
 bool fixOutputName();
 
@@ -88,6 +125,23 @@ public:
 };
 
 
+// thread placement
+enum ThreadRole {
+    THREAD_CAPTURE,
+    THREAD_VIDEO_ENCODER,
+    THREAD_AUDIO_CAPTURE,
+    THREAD_AUDIO_ENCODER,
+    THREAD_MUXER,
+    THREAD_STOPPING,
+    THREAD_ROLES_COUNT
+};
+
+void setupThreadRoles();
+bool parseThreadRoleOption(const char* key, const char* value);
+void applyThreadRole(ThreadRole role);
+int getThreadRoleCpuCount(ThreadRole role);
+const char* getThreadPlacement();
+
 void shellSetState(const char* state);
 void shellSetError(int errorCode);
 
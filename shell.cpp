@@ -119,6 +119,12 @@ int main(int argc, char* argv[]) {
             } else if (strncmp(cmd, "uninstall_audio ", 15) == 0) {
                 ALOGV("%s", cmd);
                 commandResult(cmd, requestId, uninstallAudioHAL());
+            } else if (strncmp(cmd, "recover ", 8) == 0) {
+                ALOGV("%s", cmd);
+                runRecover(requestId, args);
+            } else if (strncmp(cmd, "trim ", 5) == 0 || strncmp(cmd, "concat ", 7) == 0) {
+                ALOGV("%s", cmd);
+                runRemux(cmd[0] == 't' ? "trim" : "concat", requestId, args);
             } else if (strncmp(cmd, "kill_term ", 10) == 0) {
                 ALOGV("%s", cmd);
                 commandResult(cmd, requestId, killStrPid(args, SIGTERM));
@@ -232,6 +238,14 @@ bool processZombie() {
             cmd = "unmount_audio_master";
         }
         commandResult(cmd, mountMasterRequestId, exitValue);
+    } else if (pid == recoverPid) {
+        recoverPid = -1;
+        cmd = "recover";
+        commandResult(cmd, recoverRequestId, exitValue);
+    } else if (pid == remuxPid) {
+        remuxPid = -1;
+        cmd = remuxCmd;
+        commandResult(cmd, remuxRequestId, exitValue);
     } else {
         ALOGE("unknown process exit %d", pid);
     }
@@ -316,6 +330,54 @@ void runMountMaster(const char *executable, const char *command, const char *bas
     }
 }
 
+// Recovery reads the whole journal and writes a new moov atom, it runs in a child process
+// like remuxing so that a running recording can still be stopped.
+void runRecover(int requestId, char *path) {
+    if (recoverPid > 0) {
+        ALOGE("recover already running");
+        commandResult("recover", requestId, 191);
+        return;
+    }
+    recoverRequestId = requestId;
+    recoverPid = fork();
+    if (recoverPid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        int ret = recoverRecording(path);
+        // _exit() so that stdio buffers inherited from the shell aren't written twice
+        fflush(stdout);
+        _exit(ret);
+    } else if (recoverPid < 0) {
+        commandResult("recover", requestId, -3);
+    }
+}
+
+// Remuxing runs in a child process so that the shell stays responsive while it reads the whole file.
+void runRemux(const char *command, int requestId, char *args) {
+#ifdef SCR_FFMPEG
+    if (remuxPid > 0) {
+        // the running job keeps its request id and reports its own result
+        ALOGE("%s already running", remuxCmd);
+        commandResult(command, requestId, 191);
+        return;
+    }
+    remuxCmd = command;
+    remuxRequestId = requestId;
+    remuxPid = fork();
+    if (remuxPid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        int ret = runRemuxCommand(command, args);
+        // _exit() so that stdio buffers inherited from the shell aren't written twice
+        fflush(stdout);
+        _exit(ret);
+    } else if (remuxPid < 0) {
+        commandResult(command, remuxRequestId, -3);
+    }
+#else
+    // requires the FFmpeg build
+    commandResult(command, requestId, 190);
+#endif
+}
+
 void getSuVersion() {
     if (pipe(suPipe) < 0) {
         ALOGE("Error creating pipe!");
@@ -3,6 +3,10 @@
 
 #include "screenrec.h"
 #include "audio_hal_installer.h"
+#include "output_journal.h"
+#ifdef SCR_FFMPEG
+#include "remux.h"
+#endif
 
 #include <stdio.h>
 #include <fcntl.h>
@@ -31,6 +35,11 @@ int logcatRequestId;
 pid_t suPid = -1;
 int suPipe[2];
 pid_t mountMasterPid = -1;
+pid_t recoverPid = -1;
+int recoverRequestId;
+pid_t remuxPid = -1;
+const char *remuxCmd;
+int remuxRequestId;
 const char *mountMasterCmd;
 int mountMasterRequestId;
 
@@ -49,6 +58,8 @@ void sigPipeHandler(int param);
 void sigChldHandler(int param);
 void runLogcat(char *path);
 void runMountMaster(const char *executable, const char *command, const char *basePath);
+void runRecover(int requestId, char *path);
+void runRemux(const char *command, int requestId, char *args);
 void commandForResult(const char *command, int exitValue);
 int killStrPid(const char *strPid, int sig);
 void getSuVersion();
@@ -0,0 +1,193 @@
+#ifndef SCREENREC_SPSC_QUEUE_H
+#define SCREENREC_SPSC_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring of preallocated slots.
+// Slots are filled and consumed in place so the ring doubles as an object pool.
+// The mutex and condition variables are only touched when a side has to block
+// on an empty or full ring.
+template <class T>
+class SpscQueue {
+public:
+    SpscQueue()
+        : slots(NULL),
+          capacity(0),
+          head(0),
+          tail(0),
+          closed(0),
+          readerWaiting(0),
+          writerWaiting(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&notEmpty, NULL);
+        pthread_cond_init(&notFull, NULL);
+    }
+
+    ~SpscQueue() {
+        delete[] slots;
+    }
+
+    bool init(int size) {
+        slots = new T[size];
+        capacity = size;
+        return slots != NULL;
+    }
+
+    int getCapacity() {
+        return capacity;
+    }
+
+    // direct slot access for pool setup and cleanup, not safe while the queue is in use
+    T* slot(int i) {
+        return &slots[i];
+    }
+
+    int size() {
+        return (int) (loadAcquire(&head) - loadAcquire(&tail));
+    }
+
+    // Producer: returns the next free slot, NULL if the queue is full and block is false or if it was closed.
+    T* beginWrite(bool block) {
+        while (true) {
+            if (closed) {
+                return NULL;
+            }
+            if (loadAcquire(&head) - loadAcquire(&tail) < (uint32_t) capacity) {
+                return &slots[head % capacity];
+            }
+            if (!block) {
+                return NULL;
+            }
+            pthread_mutex_lock(&mutex);
+            writerWaiting = 1;
+            __sync_synchronize();
+            while (head - loadAcquire(&tail) >= (uint32_t) capacity && !closed) {
+                pthread_cond_wait(&notFull, &mutex);
+            }
+            writerWaiting = 0;
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    // Producer: publish the slot returned by beginWrite()
+    void commitWrite() {
+        storeRelease(&head, head + 1);
+        __sync_synchronize();
+        if (readerWaiting) {
+            pthread_mutex_lock(&mutex);
+            pthread_cond_signal(&notEmpty);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    // Consumer: returns the oldest published slot, NULL if the queue is empty and block is false
+    // or if it was closed and all remaining slots were consumed.
+    T* beginRead(bool block) {
+        while (true) {
+            if (loadAcquire(&head) != tail) {
+                return &slots[tail % capacity];
+            }
+            if (!block || closed) {
+                return NULL;
+            }
+            pthread_mutex_lock(&mutex);
+            readerWaiting = 1;
+            __sync_synchronize();
+            while (loadAcquire(&head) == tail && !closed) {
+                pthread_cond_wait(&notEmpty, &mutex);
+            }
+            readerWaiting = 0;
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    // Consumer: return the slot obtained from beginRead() to the producer
+    void commitRead() {
+        storeRelease(&tail, tail + 1);
+        __sync_synchronize();
+        if (writerWaiting) {
+            pthread_mutex_lock(&mutex);
+            pthread_cond_signal(&notFull);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+    // Wake up both sides. The consumer may still drain published slots.
+    void close() {
+        pthread_mutex_lock(&mutex);
+        closed = 1;
+        pthread_cond_broadcast(&notEmpty);
+        pthread_cond_broadcast(&notFull);
+        pthread_mutex_unlock(&mutex);
+    }
+
+private:
+    T *slots;
+    int capacity;
+
+    // free running counters, slot index is counter % capacity
+    // (they would need 2^32 items to wrap which is years of recording)
+    volatile uint32_t head; // written by producer only
+    volatile uint32_t tail; // written by consumer only
+    volatile int32_t closed;
+
+    volatile int32_t readerWaiting;
+    volatile int32_t writerWaiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+
+    static inline uint32_t loadAcquire(volatile uint32_t *value) {
+        uint32_t v = *value;
+        __sync_synchronize();
+        return v;
+    }
+
+    static inline void storeRelease(volatile uint32_t *value, uint32_t v) {
+        __sync_synchronize();
+        *value = v;
+    }
+};
+
+// Sleep/wakeup helper for threads waiting on a condition spanning several lock-free queues.
+// Waiters check their condition in a loop between beginWait() and endWait(),
+// notifiers update the shared state first and call notify() which locks the mutex only if someone waits.
+class QueueEvent {
+public:
+    QueueEvent() : waiters(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    void beginWait() {
+        pthread_mutex_lock(&mutex);
+        waiters++;
+        __sync_synchronize();
+    }
+
+    void wait() {
+        pthread_cond_wait(&cond, &mutex);
+    }
+
+    void endWait() {
+        waiters--;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void notify() {
+        __sync_synchronize();
+        if (waiters) {
+            pthread_mutex_lock(&mutex);
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+
+private:
+    volatile int32_t waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+#endif
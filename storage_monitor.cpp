@@ -0,0 +1,170 @@
+#include "storage_monitor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+
+// the monitor thread checks for stop() this often while waiting for the next reading
+#define STORAGE_POLL_MS 100
+
+bool StorageMonitor::start(const char *path, int intervalMs, int64_t extraReserve) {
+    strncpy(this->path, path, sizeof(this->path) - 1);
+    this->path[sizeof(this->path) - 1] = '\0';
+    this->intervalMs = intervalMs;
+    this->extraReserve = extraReserve;
+    stopRequested = false;
+    if (pthread_create(&thread, NULL, StorageMonitor::threadStart, this) != 0) {
+        ALOGW("Can't start storage monitor thread");
+        this->intervalMs = 0;
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void StorageMonitor::stop() {
+    if (running) {
+        running = false;
+        stopRequested = true;
+        pthread_join(thread, NULL);
+    }
+}
+
+void StorageMonitor::addWrite(int size, int64_t timeUs) {
+    int32_t writeUs = timeUs < INT32_MAX ? timeUs : INT32_MAX;
+    __sync_fetch_and_add(&windowBytes, size);
+    __sync_fetch_and_add(&windowWriteUs, writeUs);
+    __sync_fetch_and_add(&windowWrites, 1);
+    int32_t previous = windowMaxWriteUs;
+    while (writeUs > previous && !__sync_bool_compare_and_swap(&windowMaxWriteUs, previous, writeUs)) {
+        previous = windowMaxWriteUs;
+    }
+}
+
+void* StorageMonitor::threadStart(void* args) {
+    static_cast<StorageMonitor*>(args)->run();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void StorageMonitor::run() {
+    int64_t lastUs = getTimeUs();
+    while (!stopRequested) {
+        usleep(STORAGE_POLL_MS * 1000);
+        int64_t now = getTimeUs();
+        if (now - lastUs >= intervalMs * 1000ll) {
+            update(now - lastUs);
+            lastUs = now;
+        }
+    }
+}
+
+int64_t StorageMonitor::getFreeSpace() {
+    struct statfs stats;
+    if (statfs(path, &stats) != 0) {
+        ALOGV("Can't retrieve free storage space %s", strerror(errno));
+        return -1;
+    }
+    return stats.f_bavail * (int64_t) stats.f_bsize;
+}
+
+void StorageMonitor::update(int64_t intervalUs) {
+    int32_t bytes = __sync_lock_test_and_set(&windowBytes, 0);
+    int32_t writeUs = __sync_lock_test_and_set(&windowWriteUs, 0);
+    int32_t writes = __sync_lock_test_and_set(&windowWrites, 0);
+    int32_t windowMaxUs = __sync_lock_test_and_set(&windowMaxWriteUs, 0);
+    totalBytes += bytes;
+    if (segmentReset) {
+        segmentReset = false;
+        segmentStartBytes = totalBytes;
+    }
+    if (windowMaxUs > maxWriteUs) {
+        maxWriteUs = windowMaxUs;
+    }
+
+    int64_t rate = bytes * 1000000ll / intervalUs;
+    avgRate = readings == 0 ? rate : (avgRate * 3 + rate) / 4;
+    readings++;
+
+    // writes taking most of the time mean the storage barely keeps up with the encoders
+    int busy = writeUs * 100ll / intervalUs;
+    if (busy >= STORAGE_BUSY_PERCENT) {
+        fastReadings = 0;
+        if (++slowReadings >= STORAGE_SLOW_READINGS && throughputLevel < STORAGE_LEVELS - 1) {
+            throughputLevel++;
+            slowReadings = 0;
+        }
+    } else if (busy < STORAGE_IDLE_PERCENT) {
+        slowReadings = 0;
+        if (++fastReadings >= STORAGE_FAST_READINGS && throughputLevel > 0) {
+            throughputLevel--;
+            fastReadings = 0;
+        }
+    } else {
+        slowReadings = 0;
+        fastReadings = 0;
+    }
+
+    int64_t freeSpace = getFreeSpace();
+    int64_t remainingSec = -1;
+    if (freeSpace >= 0) {
+        if (minFreeSpace < 0 || freeSpace < minFreeSpace) {
+            minFreeSpace = freeSpace;
+        }
+        int64_t segmentBytes = totalBytes - segmentStartBytes;
+        int64_t usable = freeSpace - STORAGE_RESERVE_BYTES - extraReserve - segmentBytes * STORAGE_TRAILER_PERCENT / 100;
+        if (avgRate > 0) {
+            remainingSec = usable > 0 ? usable / avgRate : 0;
+        }
+
+        if (usable <= 0 || (remainingSec >= 0 && remainingSec < STORAGE_STOP_SECONDS)) {
+            if (!stoppedForSpace) {
+                // stopped like by SIGINT so that the file is completed while there is space for the trailer
+                stoppedForSpace = true;
+                ALOGW("Stopping, %lldkB of storage space left", freeSpace / 1024);
+                printf("storage_full %lldMB\n", freeSpace / (1024 * 1024));
+                fflush(stdout);
+                finished = true;
+            }
+        } else if (remainingSec >= 0) {
+            // space only goes down, the level isn't lowered again when a lower bitrate buys more time
+            int lowLevel = remainingSec < STORAGE_LOW_SECONDS / 4 ? STORAGE_LEVELS - 1 : remainingSec < STORAGE_LOW_SECONDS / 2 ? 2
+                    : remainingSec < STORAGE_LOW_SECONDS ? 1 : 0;
+            if (lowLevel > spaceLevel) {
+                spaceLevel = lowLevel;
+            }
+        }
+
+        if (spaceLevel > 0 && !splitDone && !stoppedForSpace && segmentBytes >= STORAGE_SPLIT_MIN_SIZE) {
+            ALOGW("Low storage space, completing the current file of %lld bytes", segmentBytes);
+            splitDone = true;
+            splitRequested = true;
+        }
+    }
+
+    int newLevel = spaceLevel > throughputLevel ? spaceLevel : throughputLevel;
+    if (newLevel != level) {
+        ALOGW("storage level %d -> %d, %lldB/s, %d%% busy, %llds left", level, newLevel, avgRate, busy, remainingSec);
+        level = newLevel;
+        if (newLevel > maxLevel) {
+            maxLevel = newLevel;
+        }
+    }
+
+    printf("storage %.1fMB/s %d%% %dms %dms %lldMB %llds %d\n",
+            rate / 1000000.0f, busy, writes > 0 ? writeUs / writes / 1000 : 0, windowMaxUs / 1000,
+            freeSpace >= 0 ? freeSpace / (1024 * 1024) : -1, remainingSec, level);
+    fflush(stdout);
+}
+
+void StorageMonitor::printStats() {
+    if (readings == 0) {
+        return;
+    }
+    ALOGI("storage monitor %d readings, max level %d, min free %lldMB, max write %dms, stopped %d",
+            readings, maxLevel, minFreeSpace / (1024 * 1024), maxWriteUs / 1000, stoppedForSpace);
+    printf("storage_monitor %d %d %lldMB %dms %d\n",
+            readings, maxLevel, minFreeSpace / (1024 * 1024), maxWriteUs / 1000, stoppedForSpace);
+    fflush(stdout);
+}
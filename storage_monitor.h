@@ -0,0 +1,134 @@
+#ifndef SCREENREC_STORAGE_MONITOR_H
+#define SCREENREC_STORAGE_MONITOR_H
+
+#include "screenrec.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+// space left for the muxer trailer and sidecar files when the recording is stopped
+#define STORAGE_RESERVE_BYTES (16ll * 1024 * 1024)
+// percent of the current file size added to the reserve for its moov atom
+#define STORAGE_TRAILER_PERCENT 1
+
+// seconds of recording left at the current write rate at which the bitrate is lowered
+#define STORAGE_LOW_SECONDS 120
+// the recording is stopped when less than this is left
+#define STORAGE_STOP_SECONDS 3
+
+// the current file is completed early when space runs low so that it doesn't depend on the last bytes
+#define STORAGE_SPLIT_MIN_SIZE (64ll * 1024 * 1024)
+
+// percent of the time spent in write calls at which the storage is considered too slow
+#define STORAGE_BUSY_PERCENT 80
+#define STORAGE_IDLE_PERCENT 40
+// readings in a row needed to change the throughput level
+#define STORAGE_SLOW_READINGS 3
+#define STORAGE_FAST_READINGS 10
+
+// bitrate reduction levels, 0 is the configured bitrate
+#define STORAGE_LEVELS 4
+
+// Watches write throughput and latency reported by the file writer thread and the free space
+// of the output file system. A reading is taken every interval on a separate thread so that
+// a slow statfs() doesn't delay the muxer. The monitor only publishes its decisions, the encoder
+// lowers the bitrate according to getLevel(), the muxer completes the current file when
+// isSplitRequested() and the recording is stopped like after SIGINT when space runs out.
+class StorageMonitor {
+public:
+    StorageMonitor()
+        : running(false),
+          stopRequested(false),
+          intervalMs(0),
+          extraReserve(0),
+          windowBytes(0),
+          windowWriteUs(0),
+          windowWrites(0),
+          windowMaxWriteUs(0),
+          segmentReset(false),
+          level(0),
+          splitRequested(false),
+          avgRate(0),
+          totalBytes(0),
+          segmentStartBytes(0),
+          spaceLevel(0),
+          throughputLevel(0),
+          slowReadings(0),
+          fastReadings(0),
+          splitDone(false),
+          readings(0),
+          maxLevel(0),
+          minFreeSpace(-1),
+          maxWriteUs(0),
+          stoppedForSpace(false) {
+        path[0] = '\0';
+    }
+
+    // extraReserve is added to the space kept free, e.g. for data still buffered in memory
+    bool start(const char *path, int intervalMs, int64_t extraReserve);
+    void stop();
+
+    // writer thread, called for each chunk
+    void addWrite(int size, int64_t timeUs);
+
+    // muxer thread, a new output file was started
+    void segmentStarted() {
+        segmentReset = true;
+    }
+
+    int getLevel() {
+        return level;
+    }
+
+    bool isSplitRequested() {
+        return splitRequested;
+    }
+
+    void clearSplitRequest() {
+        splitRequested = false;
+    }
+
+    void printStats();
+
+private:
+    pthread_t thread;
+    bool running;
+    volatile bool stopRequested;
+    char path[PATH_MAX];
+    int intervalMs;
+    int64_t extraReserve;
+
+    // updated by the writer thread, taken and reset by the monitor thread
+    volatile int32_t windowBytes;
+    volatile int32_t windowWriteUs;
+    volatile int32_t windowWrites;
+    volatile int32_t windowMaxWriteUs;
+
+    volatile bool segmentReset;
+    volatile int level;
+    volatile bool splitRequested;
+
+    // monitor thread
+    int64_t avgRate; // bytes per second
+    int64_t totalBytes;
+    int64_t segmentStartBytes;
+    int spaceLevel;
+    int throughputLevel;
+    int slowReadings;
+    int fastReadings;
+    bool splitDone;
+
+    // statistics
+    int readings;
+    int maxLevel;
+    int64_t minFreeSpace;
+    int32_t maxWriteUs;
+    bool stoppedForSpace;
+
+    static void* threadStart(void* args);
+    void run();
+    void update(int64_t intervalUs);
+    int64_t getFreeSpace();
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "storage_probe.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+// Finds the longest mount point in /proc/mounts containing path.
+static bool findMountPoint(const char *path, char *mountPoint) {
+    FILE *mounts = fopen("/proc/self/mounts", "r");
+    if (mounts == NULL) {
+        return false;
+    }
+    char line[1024];
+    char dir[PATH_MAX];
+    size_t bestLength = 0;
+    while (fgets(line, sizeof(line), mounts) != NULL) {
+        if (sscanf(line, "%*s %4095s", dir) != 1) {
+            continue;
+        }
+        size_t length = strlen(dir);
+        bool contains = strcmp(dir, "/") == 0 || (strncmp(path, dir, length) == 0
+                && (path[length] == '/' || path[length] == '\0'));
+        if (contains && length > bestLength) {
+            strcpy(mountPoint, dir);
+            bestLength = length;
+        }
+    }
+    fclose(mounts);
+    return bestLength > 0;
+}
+
+static bool getCachePath(char *cachePath) {
+    char exe[PATH_MAX];
+    ssize_t size = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (size <= 0) {
+        return false;
+    }
+    exe[size] = '\0';
+    snprintf(cachePath, PATH_MAX, "%s/" PROBE_CACHE_NAME, dirname(exe));
+    return true;
+}
+
+// Reads up to PROBE_CACHE_ENTRIES lines "<mount point> <device> <blocks> <bytes per second> <timestamp>".
+static int readCache(const char *cachePath, ProbeCacheEntry *entries) {
+    FILE *file = fopen(cachePath, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    int count = 0;
+    char line[PATH_MAX + 128];
+    while (count < PROBE_CACHE_ENTRIES && fgets(line, sizeof(line), file) != NULL) {
+        ProbeCacheEntry *entry = &entries[count];
+        if (sscanf(line, "%4095s %llu %llu %lld %ld", entry->mountPoint, &entry->device, &entry->blocks,
+                &entry->bytesPerSecond, &entry->timestamp) == 5) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+// The cache is replaced with rename() so that concurrent recordings never see a partial file.
+static void writeCache(const char *cachePath, const ProbeCacheEntry *entries, int count) {
+    char tmpPath[PATH_MAX + 8];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath);
+    FILE *file = fopen(tmpPath, "w");
+    if (file == NULL) {
+        ALOGV("Can't write storage probe cache %s", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s %llu %llu %lld %ld\n", entries[i].mountPoint, entries[i].device, entries[i].blocks,
+                entries[i].bytesPerSecond, entries[i].timestamp);
+    }
+    if (fclose(file) != 0 || rename(tmpPath, cachePath) != 0) {
+        unlink(tmpPath);
+    }
+}
+
+// Writes a temporary file in dir in large blocks and syncs it, the time includes the sync
+// so that data sitting in the page cache doesn't count as written.
+static int64_t measureWriteSpeed(const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.screenrec_probe_%d", dir, getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        ALOGW("Can't create storage probe file %s", strerror(errno));
+        return -1;
+    }
+    unlink(path); // space is released when the file is closed, even if the process is killed
+    uint8_t *block = (uint8_t*) malloc(PROBE_BLOCK_SIZE);
+    if (block == NULL) {
+        close(fd);
+        return -1;
+    }
+    memset(block, 0x5a, PROBE_BLOCK_SIZE);
+
+    int64_t startUs = getTimeUs();
+    int64_t written = 0;
+    while (written < PROBE_SIZE && getTimeUs() - startUs < PROBE_MAX_US) {
+        ssize_t ret = write(fd, block, PROBE_BLOCK_SIZE);
+        if (ret <= 0) {
+            break;
+        }
+        written += ret;
+    }
+    bool synced = fdatasync(fd) == 0;
+    int64_t timeUs = getTimeUs() - startUs;
+    free(block);
+    close(fd);
+
+    if (!synced || written < PROBE_BLOCK_SIZE || timeUs <= 0) {
+        ALOGW("Storage probe failed, %lld bytes written", written);
+        return -1;
+    }
+    return written * 1000000ll / timeUs;
+}
+
+int64_t getWriteSpeed(const char *dir, bool *cached) {
+    char realDir[PATH_MAX];
+    char mountPoint[PATH_MAX];
+    struct stat dirStat;
+    struct statfs fsStats;
+    if (realpath(dir, realDir) == NULL || stat(realDir, &dirStat) != 0 || statfs(realDir, &fsStats) != 0) {
+        ALOGW("Can't probe %s %s", dir, strerror(errno));
+        return -1;
+    }
+    if (!findMountPoint(realDir, mountPoint)) {
+        strcpy(mountPoint, realDir);
+    }
+
+    static ProbeCacheEntry entries[PROBE_CACHE_ENTRIES];
+    char cachePath[PATH_MAX];
+    bool cacheAvailable = getCachePath(cachePath);
+    int count = cacheAvailable ? readCache(cachePath, entries) : 0;
+    long now = time(NULL);
+    for (int i = 0; i < count; i++) {
+        ProbeCacheEntry *entry = &entries[i];
+        if (strcmp(entry->mountPoint, mountPoint) == 0 && entry->device == (unsigned long long) dirStat.st_dev
+                && entry->blocks == (unsigned long long) fsStats.f_blocks && now - entry->timestamp < PROBE_CACHE_MAX_AGE) {
+            *cached = true;
+            return entry->bytesPerSecond;
+        }
+    }
+
+    *cached = false;
+    if (fsStats.f_bavail * (int64_t) fsStats.f_bsize < PROBE_MIN_FREE_SPACE) {
+        ALOGW("Not enough space for storage probe");
+        return -1;
+    }
+    int64_t speed = measureWriteSpeed(realDir);
+    if (speed <= 0 || !cacheAvailable) {
+        return speed;
+    }
+
+    // replace the entry of this mount point or the oldest one
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < count && slot < 0; i++) {
+        if (strcmp(entries[i].mountPoint, mountPoint) == 0) {
+            slot = i;
+        } else if (entries[i].timestamp < entries[oldest].timestamp) {
+            oldest = i;
+        }
+    }
+    if (slot < 0) {
+        slot = count < PROBE_CACHE_ENTRIES ? count++ : oldest;
+    }
+    ProbeCacheEntry *entry = &entries[slot];
+    strcpy(entry->mountPoint, mountPoint);
+    entry->device = dirStat.st_dev;
+    entry->blocks = fsStats.f_blocks;
+    entry->bytesPerSecond = speed;
+    entry->timestamp = now;
+    writeCache(cachePath, entries, count);
+    return speed;
+}
+
+void applyWriteProbe(int percent, bool cap) {
+    char dir[PATH_MAX];
+    strncpy(dir, outputName, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+
+    int64_t startUs = getTimeUs();
+    bool cached = false;
+    int64_t speed = getWriteSpeed(dirname(dir), &cached);
+    int64_t timeMs = (getTimeUs() - startUs) / 1000;
+    if (speed <= 0) {
+        return;
+    }
+
+    // steady state writes stay under percent of the measured bandwidth
+    int64_t sustainable = speed * 8 * percent / 100;
+    if (audioSource != SCR_AUDIO_MUTE) {
+        sustainable -= audioChannels * 64000;
+    }
+    if (sustainable < PROBE_MIN_BITRATE) {
+        sustainable = PROBE_MIN_BITRATE;
+    }
+    if (cap && videoBitrate > sustainable) {
+        ALOGW("Video bitrate %d capped to %lld, storage writes %lldkB/s", videoBitrate, sustainable, speed / 1024);
+        videoBitrate = sustainable;
+    }
+    ALOGI("storage probe %lldkB/s %s in %lldms, sustainable video bitrate %lld", speed / 1024,
+            cached ? "cached" : "measured", timeMs, sustainable);
+    printf("write_probe %.1fMB/s %s %lldms %lld %d\n", speed / 1000000.0f,
+            cached ? "cached" : "measured", timeMs, sustainable, videoBitrate);
+    fflush(stdout);
+}
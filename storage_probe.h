@@ -0,0 +1,42 @@
+#ifndef SCREENREC_STORAGE_PROBE_H
+#define SCREENREC_STORAGE_PROBE_H
+
+#include "screenrec.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+// the probe writes up to PROBE_SIZE in PROBE_BLOCK_SIZE blocks but stops after PROBE_MAX_US
+#define PROBE_SIZE (16 * 1024 * 1024)
+#define PROBE_BLOCK_SIZE (1024 * 1024)
+#define PROBE_MAX_US 1500000
+// the probe is skipped when the file system is almost full
+#define PROBE_MIN_FREE_SPACE (64ll * 1024 * 1024)
+
+// measurements are cached next to the executable and repeated after this time
+#define PROBE_CACHE_NAME "storage_probe"
+#define PROBE_CACHE_ENTRIES 16
+#define PROBE_CACHE_MAX_AGE (30 * 24 * 3600)
+
+// the video bitrate isn't capped below this
+#define PROBE_MIN_BITRATE 1000000
+
+// Cached result of a write probe. A mount point is identified by its path, device
+// and size so that a different SD card in the same slot is measured again.
+struct ProbeCacheEntry {
+    char mountPoint[PATH_MAX];
+    unsigned long long device;
+    unsigned long long blocks;
+    long long bytesPerSecond;
+    long timestamp;
+};
+
+// Returns the sequential write speed of the file system holding dir in bytes per second,
+// measured with a short fdatasync'ed write or taken from the cache. Returns -1 on failure.
+int64_t getWriteSpeed(const char *dir, bool *cached);
+
+// Caps videoBitrate to percent of the write speed of the output directory, taking the audio
+// bitrate into account. With cap disabled the sustainable bitrate is only reported.
+void applyWriteProbe(int percent, bool cap);
+
+#endif
@@ -0,0 +1,182 @@
+// Encodes synthetic 60 fps frames with jittered, repeated and backwards capture times through
+// FFmpegOutput and checks the timestamps of the encoder input and of the muxed video packets.
+//
+// adb push screenrec_pts_test /data/local/tmp && adb shell /data/local/tmp/screenrec_pts_test
+// Exits with 0 if all checks passed.
+
+#include "ffmpeg_output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_FRAMES 600
+#define TEST_FRAME_RATE 60
+#define TEST_JITTER_US 6000
+
+// main.cpp refers to the shell which isn't linked into the test
+void shellSetState(const char* state) {
+    ALOGV("%s", state);
+}
+
+void shellSetError(int errorCode) {
+    fprintf(stderr, "error %d\n", errorCode);
+}
+
+class PtsTest {
+public:
+    static int run(const char *path);
+
+private:
+    static int encodeFrames(FFmpegOutput *output);
+    static int checkOutput(const char *path);
+};
+
+// Capture times are spread around the nominal frame period. Some frames are captured within
+// the same time base tick, with the same time as the previous one (also several in a row)
+// or earlier than the previous one, e.g. after a clock adjustment. Returns the number of
+// frames whose pts doesn't follow the previous one.
+int PtsTest::encodeFrames(FFmpegOutput *output) {
+    int64_t periodUs = 1000000 / TEST_FRAME_RATE;
+    int64_t captureTimeUs = 0;
+    int64_t lastPts = AV_NOPTS_VALUE;
+    int errors = 0;
+    srand(1);
+    for (int i = 0; i < TEST_FRAMES; i++) {
+        int phase = i % 100;
+        if (phase == 7 || (phase >= 60 && phase < 64)) {
+            // same capture time
+        } else if (phase == 23) {
+            captureTimeUs += 1;
+        } else if (phase == 41) {
+            captureTimeUs -= 3 * periodUs;
+        } else if (phase == 42) {
+            captureTimeUs -= 1;
+        } else {
+            captureTimeUs = TEST_JITTER_US + i * periodUs + rand() % (2 * TEST_JITTER_US) - TEST_JITTER_US;
+        }
+        output->writeVideoFrame(output->startTimeUs + captureTimeUs);
+
+        AVFrame **slot = output->frameQueue.beginRead(false);
+        if (slot == NULL) {
+            fprintf(stderr, "FAIL frame %d not queued\n", i);
+            errors++;
+            continue;
+        }
+        AVFrame *frame = *slot;
+        if (lastPts != AV_NOPTS_VALUE && frame->pts <= lastPts) {
+            fprintf(stderr, "FAIL frame %d pts %lld after %lld\n", i, frame->pts, lastPts);
+            errors++;
+        }
+        lastPts = frame->pts;
+        // moving gradient so that the encoder produces P and B frames of varying size
+        for (int y = 0; y < frame->height; y++) {
+            memset(frame->data[0] + y * frame->linesize[0], (y + i * 4) & 0xff, frame->width);
+        }
+        output->encodeAndSaveVideoFrame(frame);
+        output->frameQueue.commitRead();
+    }
+    output->flushVideoEncoder();
+    return errors;
+}
+
+static int compareTimestamps(const void *a, const void *b) {
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int PtsTest::checkOutput(const char *path) {
+    extern AVInputFormat ff_mov_demuxer;
+    av_register_input_format(&ff_mov_demuxer);
+
+    AVFormatContext *ic = NULL;
+    if (avformat_open_input(&ic, path, NULL, NULL) < 0 || avformat_find_stream_info(ic, NULL) < 0) {
+        fprintf(stderr, "FAIL can't read %s\n", path);
+        return 1;
+    }
+    int videoIndex = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (videoIndex < 0) {
+        fprintf(stderr, "FAIL no video stream\n");
+        avformat_close_input(&ic);
+        return 1;
+    }
+
+    int64_t *pts = new int64_t[TEST_FRAMES + 1];
+    int count = 0;
+    int errors = 0;
+    int64_t lastDts = AV_NOPTS_VALUE;
+    AVPacket pkt;
+    while (av_read_frame(ic, &pkt) >= 0) {
+        if (pkt.stream_index == videoIndex) {
+            if (pkt.pts == AV_NOPTS_VALUE || pkt.dts == AV_NOPTS_VALUE) {
+                fprintf(stderr, "FAIL packet %d without timestamp\n", count);
+                errors++;
+            } else if (lastDts != AV_NOPTS_VALUE && pkt.dts <= lastDts) {
+                fprintf(stderr, "FAIL packet %d dts %lld after %lld\n", count, pkt.dts, lastDts);
+                errors++;
+            } else if (pkt.pts < pkt.dts) {
+                fprintf(stderr, "FAIL packet %d pts %lld before dts %lld\n", count, pkt.pts, pkt.dts);
+                errors++;
+            }
+            lastDts = pkt.dts;
+            if (count <= TEST_FRAMES) {
+                pts[count] = pkt.pts;
+            }
+            count++;
+        }
+        av_free_packet(&pkt);
+    }
+    avformat_close_input(&ic);
+
+    if (count != TEST_FRAMES) {
+        fprintf(stderr, "FAIL %d video packets, %d frames encoded\n", count, TEST_FRAMES);
+        errors++;
+    }
+    // in presentation order pts must strictly increase, which also rules out duplicates
+    int sorted = count < TEST_FRAMES ? count : TEST_FRAMES;
+    qsort(pts, sorted, sizeof(int64_t), compareTimestamps);
+    for (int i = 1; i < sorted; i++) {
+        if (pts[i] <= pts[i - 1]) {
+            fprintf(stderr, "FAIL pts %lld presented after %lld\n", pts[i], pts[i - 1]);
+            errors++;
+        }
+    }
+    delete[] pts;
+    return errors;
+}
+
+int PtsTest::run(const char *path) {
+    outputName = (char*) path;
+    frameRate = TEST_FRAME_RATE;
+    videoWidth = 320;
+    videoHeight = 240;
+    videoBitrate = 2000000;
+    audioSource = SCR_AUDIO_MUTE;
+    storageMonitorInterval = 0;
+    keyframeIndex = false;
+    outputJournal = false;
+
+    // the pipeline of setupOutput() without the capture and encoder threads,
+    // frames are encoded on this thread as soon as they are queued
+    FFmpegOutput *output = new FFmpegOutput();
+    output->loadFFmpegComponents();
+    output->setupOutputContext();
+    output->setupVideoStream();
+    output->setupFrames();
+    output->setupOutputFile();
+    output->startMuxer();
+    output->startTimeUs = getTimeUs();
+
+    int errors = encodeFrames(output);
+    output->closeOutput(true);
+
+    errors += checkOutput(path);
+    unlink(path);
+    printf("%s %d frames, %d errors\n", errors == 0 ? "PASS" : "FAIL", TEST_FRAMES, errors);
+    return errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    return PtsTest::run(argc > 1 ? argv[1] : "/data/local/tmp/screenrec_pts_test.mp4");
+}
@@ -0,0 +1,183 @@
+#include "thread_roles.h"
+
+// Classify CPUs into big and little clusters by their cpufreq max frequency.
+// CPUs with the lowest max frequency are "little", all faster ones (including prime cores) are "big".
+// On homogeneous systems both masks cover all CPUs.
+void setupThreadRoles() {
+    char present[64];
+    FILE *file = fopen(CPU_SYSFS_PATH "/present", "r");
+    if (file == NULL || fgets(present, sizeof(present), file) == NULL) {
+        ALOGW("Can't read CPU topology %s", strerror(errno));
+        if (file != NULL) {
+            fclose(file);
+        }
+        return;
+    }
+    fclose(file);
+
+    allCpus = parseCpuList(present);
+
+    int maxFreq[MAX_CPUS];
+    int minFreq = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        maxFreq[cpu] = 0;
+        if (allCpus & (1ul << cpu)) {
+            maxFreq[cpu] = readCpuSysInt(cpu, "cpufreq/cpuinfo_max_freq");
+            if (maxFreq[cpu] > 0 && (minFreq == 0 || maxFreq[cpu] < minFreq)) {
+                minFreq = maxFreq[cpu];
+            }
+        }
+    }
+
+    bigCpus = 0;
+    littleCpus = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (maxFreq[cpu] <= 0) {
+            continue;
+        }
+        if (maxFreq[cpu] > minFreq) {
+            bigCpus |= 1ul << cpu;
+        } else {
+            littleCpus |= 1ul << cpu;
+        }
+    }
+
+    if (bigCpus == 0 || littleCpus == 0) {
+        bigCpus = allCpus;
+        littleCpus = allCpus;
+    }
+    ALOGV("CPU topology all: %#lx big: %#lx little: %#lx", allCpus, bigCpus, littleCpus);
+}
+
+int readCpuSysInt(int cpu, const char *file) {
+    char path[128];
+    int value = 0;
+    sprintf(path, CPU_SYSFS_PATH "/cpu%d/%s", cpu, file);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%d", &value) != 1) {
+        value = 0;
+    }
+    fclose(f);
+    return value;
+}
+
+// parse kernel cpu list format e.g. "0-3,6"
+unsigned long parseCpuList(const char *list) {
+    unsigned long mask = 0;
+    const char *p = list;
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        int first = strtol(p, &end, 10);
+        int last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (int cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++) {
+            mask |= 1ul << cpu;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return mask;
+}
+
+// "cpu_<role>=big|little|all|<list>" and "prio_<role>=<nice>|fifo<priority>"
+bool parseThreadRoleOption(const char* key, const char* value) {
+    bool affinity = strncmp(key, "cpu_", 4) == 0;
+    bool priority = strncmp(key, "prio_", 5) == 0;
+    if (!affinity && !priority) {
+        return false;
+    }
+    const char *roleName = strchr(key, '_') + 1;
+    for (int i = 0; i < THREAD_ROLES_COUNT; i++) {
+        ThreadRoleConfig *config = &threadRoles[i];
+        if (strcmp(roleName, config->name) != 0) {
+            continue;
+        }
+        if (affinity) {
+            strncpy(config->cpus, value, sizeof(config->cpus) - 1);
+            config->cpus[sizeof(config->cpus) - 1] = '\0';
+        } else if (strncmp(value, "fifo", 4) == 0) {
+            config->fifoPriority = atoi(value + 4);
+        } else {
+            config->nice = atoi(value);
+        }
+        return true;
+    }
+    ALOGW("unknown thread role %s", roleName);
+    return true;
+}
+
+unsigned long getRoleCpuMask(ThreadRoleConfig *config) {
+    if (strcmp(config->cpus, "big") == 0) {
+        return bigCpus;
+    } else if (strcmp(config->cpus, "little") == 0) {
+        return littleCpus;
+    } else if (strcmp(config->cpus, "all") == 0) {
+        return allCpus;
+    }
+    return parseCpuList(config->cpus) & allCpus;
+}
+
+// Should be called from the thread taking the role.
+// The mask is always set, even for "all", as threads inherit affinity from the thread which created them.
+void applyThreadRole(ThreadRole role) {
+    ThreadRoleConfig *config = &threadRoles[role];
+    pid_t tid = gettid();
+
+    unsigned long mask = getRoleCpuMask(config);
+    if (mask != 0) {
+        if (syscall(__NR_sched_setaffinity, tid, sizeof(mask), &mask) != 0) {
+            // e.g. the whole big cluster may be hotplugged off
+            ALOGW("Can't set %s thread affinity %#lx: %s", config->name, mask, strerror(errno));
+        }
+    }
+
+    if (config->fifoPriority > 0) {
+        struct sched_param param;
+        param.sched_priority = config->fifoPriority;
+        if (sched_setscheduler(tid, SCHED_FIFO, &param) != 0) {
+            ALOGW("Can't set %s thread SCHED_FIFO %d: %s", config->name, config->fifoPriority, strerror(errno));
+        }
+    } else if (config->nice != NICE_UNCHANGED) {
+        if (setpriority(PRIO_PROCESS, tid, config->nice) != 0) {
+            ALOGW("Can't set %s thread nice %d: %s", config->name, config->nice, strerror(errno));
+        }
+    }
+    ALOGV("%s thread %d affinity %#lx", config->name, tid, mask);
+}
+
+int getThreadRoleCpuCount(ThreadRole role) {
+    unsigned long mask = getRoleCpuMask(&threadRoles[role]);
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        count++;
+    }
+    return count;
+}
+
+// placement summary used in test mode benchmark output e.g. "capture:big encoder:big/-4 audio:all/fifo2"
+const char* getThreadPlacement() {
+    int length = 0;
+    threadPlacement[0] = '\0';
+    for (int i = 0; i < THREAD_ROLES_COUNT && length < (int) sizeof(threadPlacement); i++) {
+        ThreadRoleConfig *config = &threadRoles[i];
+        length += snprintf(threadPlacement + length, sizeof(threadPlacement) - length, "%s%s:%s",
+                i == 0 ? "" : " ", config->name, config->cpus);
+        if (length >= (int) sizeof(threadPlacement)) {
+            break;
+        }
+        if (config->fifoPriority > 0) {
+            length += snprintf(threadPlacement + length, sizeof(threadPlacement) - length, "/fifo%d", config->fifoPriority);
+        } else if (config->nice != NICE_UNCHANGED) {
+            length += snprintf(threadPlacement + length, sizeof(threadPlacement) - length, "/%d", config->nice);
+        }
+    }
+    return threadPlacement;
+}
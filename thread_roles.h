@@ -0,0 +1,45 @@
+#ifndef SCREENREC_THREAD_ROLES_H
+#define SCREENREC_THREAD_ROLES_H
+
+#include "screenrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define MAX_CPUS 32
+#define CPU_SYSFS_PATH "/sys/devices/system/cpu"
+#define NICE_UNCHANGED 100
+
+struct ThreadRoleConfig {
+    const char *name;
+    char cpus[16]; // "big", "little", "all" or explicit list e.g. "4-7" or "0,2"
+    int nice;
+    int fifoPriority;
+};
+
+ThreadRoleConfig threadRoles[THREAD_ROLES_COUNT] = {
+    { "capture",  "big", NICE_UNCHANGED, 0 },
+    { "encoder",  "big", NICE_UNCHANGED, 0 },
+    { "audio",    "all", NICE_UNCHANGED, 0 },
+    { "audio_enc", "all", NICE_UNCHANGED, 0 },
+    { "muxer",    "all", NICE_UNCHANGED, 0 },
+    { "stopping", "all", NICE_UNCHANGED, 0 },
+};
+
+// cpu masks derived from cpufreq max frequencies
+unsigned long allCpus = 0;
+unsigned long bigCpus = 0;
+unsigned long littleCpus = 0;
+
+char threadPlacement[256];
+
+int readCpuSysInt(int cpu, const char *file);
+unsigned long parseCpuList(const char *list);
+unsigned long getRoleCpuMask(ThreadRoleConfig *config);
+
+#endif